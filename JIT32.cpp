@@ -0,0 +1,498 @@
+#include "RISCV32.h"
+#include <cstdint>
+#include <vector>
+
+#include <sys/mman.h>
+
+#if defined(__x86_64__)
+
+// Host registers
+#define RAX 0
+#define RCX 1
+#define RDX 2 // pc_next pointer
+#define RBX 3
+#define RSP 4
+#define RBP 5
+#define RSI 6 // guest memory base
+#define RDI 7 // xreg base, biased by JIT_REG_BIAS
+#define R8  8
+#define R9  9
+#define R10 10
+#define R11 11
+#define R12 12
+#define R13 13
+#define R14 14
+#define R15 15
+
+// Guest registers are 8-byte slots; biasing the base keeps every offset within a disp8
+#define JIT_REG_BIAS 16
+#define REG_DISP(guest) ((uint8_t)(((int)(guest) - JIT_REG_BIAS) * 8))
+
+// Condition codes
+#define CC_B  0x2
+#define CC_AE 0x3
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_L  0xC
+#define CC_GE 0xD
+
+// Host registers guest registers may live in, callee-saved ones first
+static const int alloc_order[] = {RBX, RBP, R12, R13, R14, R15, R8, R9, R10, R11};
+static const int alloc_count = sizeof(alloc_order) / sizeof(alloc_order[0]);
+static const int saved_regs[] = {RBX, RBP, R12, R13, R14, R15};
+static const int saved_count = sizeof(saved_regs) / sizeof(saved_regs[0]);
+
+class Emitter {
+    private:
+        uint8_t* buf;
+        size_t cap;
+        size_t len;
+
+    public:
+        // Guest register -> host register, -1 if kept in xreg[]
+        int host[32];
+
+        Emitter(uint8_t* buf, size_t cap) : buf(buf), cap(cap), len(0) {}
+        size_t size() const { return len; }
+        bool overflow() const { return len > cap; }
+
+        void u8(uint8_t v) {
+            if (len < cap) buf[len] = v;
+            len++;
+        }
+        void u32(uint32_t v) {
+            u8(v & 0xFF); u8((v >> 8) & 0xFF); u8((v >> 16) & 0xFF); u8((v >> 24) & 0xFF);
+        }
+        void patch32(size_t at, uint32_t v) {
+            if (at + 4 > cap) return;
+            buf[at] = v & 0xFF; buf[at + 1] = (v >> 8) & 0xFF;
+            buf[at + 2] = (v >> 16) & 0xFF; buf[at + 3] = (v >> 24) & 0xFF;
+        }
+        void rex(int reg, int rm) {
+            if (reg >= 8 || rm >= 8) u8(0x40 | ((reg >> 3) << 2) | (rm >> 3));
+        }
+
+        // op r/m32, r32
+        void rr(uint8_t op, int reg, int rm) {
+            rex(reg, rm); u8(op); u8(0xC0 | ((reg & 7) << 3) | (rm & 7));
+        }
+        // op r32, [rdi + disp8] / op [rdi + disp8], r32
+        void rdi_mem(uint8_t op, int reg, uint8_t disp) {
+            rex(reg, RDI); u8(op); u8(0x40 | ((reg & 7) << 3) | RDI); u8(disp);
+        }
+        void mov_imm(int reg, uint32_t imm) {
+            rex(0, reg); u8(0xB8 | (reg & 7)); u32(imm);
+        }
+        // group 1 (add/or/and/sub/xor/cmp) r/m32, imm32
+        void alu_imm(int digit, int reg, uint32_t imm) {
+            rex(0, reg); u8(0x81); u8(0xC0 | (digit << 3) | (reg & 7)); u32(imm);
+        }
+        void shift_imm(int digit, int reg, uint8_t amount) {
+            rex(0, reg); u8(0xC1); u8(0xC0 | (digit << 3) | (reg & 7)); u8(amount);
+        }
+        void shift_cl(int digit, int reg) {
+            rex(0, reg); u8(0xD3); u8(0xC0 | (digit << 3) | (reg & 7));
+        }
+        // eax = (eax <cc> operand) ? 1 : 0, flags already set
+        void setcc_eax(int cc) {
+            u8(0x0F); u8(0x90 | cc); u8(0xC0);
+            u8(0x0F); u8(0xB6); u8(0xC0);
+        }
+        size_t jcc(int cc) {
+            u8(0x0F); u8(0x80 | cc); u32(0);
+            return len - 4;
+        }
+        size_t jmp() {
+            u8(0xE9); u32(0);
+            return len - 4;
+        }
+        void bind(size_t at) { patch32(at, len - (at + 4)); }
+        void bind_to(size_t at, size_t target) { patch32(at, target - (at + 4)); }
+        void push(int reg) { rex(0, reg); u8(0x50 | (reg & 7)); }
+        void pop(int reg) { rex(0, reg); u8(0x58 | (reg & 7)); }
+        void ret() { u8(0xC3); }
+
+        // Mark page number reg (below r8) dirty, clobbers reg
+        void mark_dirty_page(int reg) {
+            u8(0xC6); u8(0x84); u8(((reg & 7) << 3) | RSI); u32(-(int32_t)MEM_DIRTY_BYTES); u8(1); // mov byte [rsi + reg - MEM_DIRTY_BYTES], 1
+            shift_imm(5, reg, MEM_DIRTY_GROUP_SHIFT);
+            u8(0xC6); u8(0x84); u8(((reg & 7) << 3) | RSI); u32(-(int32_t)(MEM_DIRTY_BYTES + MEM_DIRTY_GROUP_BYTES)); u8(1); // and its group
+        }
+
+        // Flags NE if the page at guest address reg holds decoded code; leaves the page number in reg
+        void test_code(int reg) {
+            shift_imm(5, reg, MEM_PAGE_SHIFT);
+            u8(0x80); u8(0xBC); u8(((reg & 7) << 3) | RSI); u32(-(int32_t)(MEM_DIRTY_BYTES + MEM_DIRTY_GROUP_BYTES + MEM_CODE_BYTES)); u8(0); // cmp byte [rsi + reg - ...], 0
+        }
+
+        // *pc_next = imm / ecx
+        void store_pc_imm(uint32_t imm) { u8(0xC7); u8(0x02); u32(imm); }
+        void store_pc_ecx() { u8(0x89); u8(0x0A); }
+
+        // Guest register access, x0 reads as zero and ignores writes
+        void load(int reg, uint32_t guest) {
+            if (guest == 0) rr(0x31, reg, reg);
+            else if (host[guest] >= 0) rr(0x89, host[guest], reg);
+            else rdi_mem(0x8B, reg, REG_DISP(guest));
+        }
+        void store(int reg, uint32_t guest) {
+            if (guest == 0) return;
+            if (host[guest] >= 0) rr(0x89, reg, host[guest]);
+            else rdi_mem(0x89, reg, REG_DISP(guest));
+        }
+        void store_imm(uint32_t guest, uint32_t imm) {
+            if (guest == 0) return;
+            if (host[guest] >= 0) {
+                mov_imm(host[guest], imm);
+            } else {
+                u8(0xC7); u8(0x47); u8(REG_DISP(guest)); u32(imm);
+            }
+        }
+};
+
+#endif
+
+RISCV32::JIT32::JIT32() {
+    code_buf = nullptr; // mapped on first use
+    code_used = 0;
+}
+
+RISCV32::JIT32::~JIT32() {
+    if (code_buf != nullptr) munmap(code_buf, JIT_CODE_SIZE);
+}
+
+void RISCV32::JIT32::flush(RISCV32& hart) {
+    for (std::unordered_map<uint32_t, Block32>::iterator it = hart.block_cache.begin(); it != hart.block_cache.end(); it++) {
+        it->second.jit_code = nullptr;
+        it->second.exec_count = 0; // still hot blocks reach the threshold again
+    }
+    code_used = 0;
+}
+
+uint32_t RISCV32::JIT32::enter(RISCV32& hart, const Block32* block) {
+    return block->jit_code(hart.xreg + JIT_REG_BIAS, hart.memory.mem, &hart.pc_next);
+}
+
+// Every record before the faulting one completed, and registers cached for the block hold their
+// latest values; the epilogue never ran, so they are written back here
+const RISCV32::Decoded32* RISCV32::JIT32::locate_fault(RISCV32& hart, const Block32* block, const uint64_t* host_regs, uint64_t host_pc) {
+    if (block->jit_code == nullptr || host_pc < (uint64_t)block->jit_code) return nullptr;
+    uint64_t offset = host_pc - (uint64_t)block->jit_code;
+    const std::vector<uint16_t>& starts = block->jit_starts;
+    for (size_t k = 0; k + 1 < starts.size(); k++) {
+        if (offset < starts[k] || offset >= starts[k + 1]) continue;
+        for (int i = 1; i < 32; i++) {
+            if (block->jit_host[i] >= 0) hart.xreg[i] = (uint32_t)host_regs[block->jit_host[i]];
+        }
+        return &block->insts[k];
+    }
+    return nullptr;
+}
+
+void RISCV32::JIT32::compile(RISCV32& hart, Block32* block, bool align) {
+#if defined(__x86_64__)
+    if (code_buf == nullptr) {
+        void* buf = mmap(nullptr, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buf == MAP_FAILED) {
+            hart.jit_mode = 0;
+            return;
+        }
+        code_buf = (uint8_t*)buf;
+    }
+
+    const std::vector<Decoded32>& insts = block->insts;
+    size_t n = insts.size();
+
+    // Translatable prefix and register usage
+    int uses[32] = {0, };
+    bool written[32] = {false, };
+    size_t count = 0;
+    auto count_regs = [](const Decoded32& inst, bool uses_rd, bool uses_rs1, bool uses_rs2, int* uses) {
+        if (uses_rd) uses[inst.rd]++;
+        if (uses_rs1) uses[inst.rs1]++;
+        if (uses_rs2) uses[inst.rs2]++;
+    };
+    bool supported = true;
+    while (count < n && supported) {
+        const Decoded32& inst = insts[count];
+        switch (inst.op) {
+            case OP_LUI:
+            case OP_AUIPC:
+            case OP_JAL: {
+                count_regs(inst, true, false, false, uses);
+                written[inst.rd] = true;
+            } break;
+            case OP_JALR:
+            case OP_LB: case OP_LH: case OP_LW: case OP_LBU: case OP_LHU:
+            case OP_ADDI: case OP_SLTI: case OP_SLTIU: case OP_XORI: case OP_ORI: case OP_ANDI:
+            case OP_SLLI: case OP_SRLI: case OP_SRAI: {
+                count_regs(inst, true, true, false, uses);
+                written[inst.rd] = true;
+            } break;
+            case OP_BEQ: case OP_BNE: case OP_BLT: case OP_BGE: case OP_BLTU: case OP_BGEU:
+            case OP_SB: case OP_SH: case OP_SW: {
+                count_regs(inst, false, true, true, uses);
+            } break;
+            case OP_ADD: case OP_SUB: case OP_SLL: case OP_SLT: case OP_SLTU:
+            case OP_XOR: case OP_SRL: case OP_SRA: case OP_OR: case OP_AND:
+            case OP_MUL: case OP_MULH: case OP_MULHSU: case OP_MULHU:
+            case OP_DIV: case OP_DIVU: case OP_REM: case OP_REMU:
+            case OP_SLT_BEQ: case OP_SLT_BNE: case OP_SLTU_BEQ: case OP_SLTU_BNE: {
+                count_regs(inst, true, true, true, uses);
+                written[inst.rd] = true;
+            } break;
+            case OP_UNKNOWN:
+            case OP_FENCE: {
+                // Skipped by the interpreter as well, or a single host instruction
+            } break;
+            default: {
+                supported = false; // left to the interpreter
+            } break;
+        }
+        // Without C, jumps to a misaligned target fault in the interpreter
+        bool jump = inst.op == OP_JAL || (inst.op >= OP_BEQ && inst.op <= OP_BGEU)
+            || inst.op == OP_SLT_BEQ || inst.op == OP_SLT_BNE || inst.op == OP_SLTU_BEQ || inst.op == OP_SLTU_BNE;
+        if (jump && !hart.ext.C && ((inst.pc + inst.imm) & 2)) supported = false;
+        if (supported) count++;
+    }
+    if (count == 0) return;
+
+    if (code_used + JIT_BLOCK_MAX_CODE > JIT_CODE_SIZE) flush(hart);
+    Emitter e(code_buf + code_used, JIT_BLOCK_MAX_CODE);
+
+    // Most used guest registers live in host registers for the whole block
+    for (int i = 0; i < 32; i++) e.host[i] = -1;
+    for (int k = 0; k < alloc_count; k++) {
+        int best = 0;
+        for (int i = 1; i < 32; i++) {
+            if (e.host[i] < 0 && uses[i] > uses[best]) best = i;
+        }
+        if (best == 0 || uses[best] < 2) break;
+        e.host[best] = alloc_order[k];
+    }
+
+    // Prologue
+    for (int i = 0; i < saved_count; i++) e.push(saved_regs[i]);
+    for (int i = 1; i < 32; i++) {
+        if (e.host[i] >= 0) e.rdi_mem(0x8B, e.host[i], REG_DISP(i));
+    }
+
+    // Exits: (jump to patch, instructions completed)
+    std::vector<std::pair<size_t, uint32_t> > exits;
+    // Where each record starts, so a fault in host code finds its record
+    std::vector<uint16_t> starts;
+
+    for (size_t k = 0; k < count; k++) {
+        const Decoded32& inst = insts[k];
+        uint32_t imm = inst.imm;
+        starts.push_back(e.size());
+
+        switch (inst.op) {
+            case OP_LUI: {
+                e.store_imm(inst.rd, imm);
+            } break;
+            case OP_AUIPC: {
+                e.store_imm(inst.rd, inst.pc + imm);
+            } break;
+            case OP_JAL: {
+                e.store_imm(inst.rd, inst.pc + inst.len);
+                e.store_pc_imm(inst.pc + imm);
+            } break;
+            case OP_JALR: {
+                e.load(RCX, inst.rs1);
+                e.alu_imm(0, RCX, imm);
+                e.alu_imm(4, RCX, 0xFFFFFFFE);
+                if (!hart.ext.C) {
+                    e.u8(0xF7); e.u8(0xC1); e.u32(2); // test ecx, 2; a misaligned target faults in the interpreter
+                    exits.push_back(std::make_pair(e.jcc(CC_NE), (uint32_t)k));
+                }
+                e.store_pc_ecx();
+                e.store_imm(inst.rd, inst.pc + inst.len);
+            } break;
+
+            case OP_BEQ: case OP_BNE: case OP_BLT: case OP_BGE: case OP_BLTU: case OP_BGEU: {
+                int cc = (inst.op == OP_BEQ) ? CC_E : (inst.op == OP_BNE) ? CC_NE
+                    : (inst.op == OP_BLT) ? CC_L : (inst.op == OP_BGE) ? CC_GE
+                    : (inst.op == OP_BLTU) ? CC_B : CC_AE;
+                e.load(RAX, inst.rs1);
+                e.load(RCX, inst.rs2);
+                e.rr(0x39, RCX, RAX);
+                size_t not_taken = e.jcc(cc ^ 1);
+                e.store_pc_imm(inst.pc + imm);
+                e.bind(not_taken);
+            } break;
+            case OP_SLT_BEQ: case OP_SLT_BNE: case OP_SLTU_BEQ: case OP_SLTU_BNE: {
+                // setcc and the stores leave the flags of the compare for the branch
+                int cc = (inst.op == OP_SLT_BEQ || inst.op == OP_SLT_BNE) ? CC_L : CC_B;
+                if (inst.op == OP_SLT_BEQ || inst.op == OP_SLTU_BEQ) cc ^= 1;
+                e.load(RAX, inst.rs1);
+                e.load(RCX, inst.rs2);
+                e.rr(0x39, RCX, RAX);
+                e.setcc_eax((inst.op == OP_SLT_BEQ || inst.op == OP_SLT_BNE) ? CC_L : CC_B);
+                e.store(RAX, inst.rd);
+                size_t not_taken = e.jcc(cc ^ 1);
+                e.store_pc_imm(inst.pc + imm);
+                e.bind(not_taken);
+            } break;
+
+            case OP_LB: case OP_LH: case OP_LW: case OP_LBU: case OP_LHU:
+            case OP_SB: case OP_SH: case OP_SW: {
+                uint32_t width = (inst.op == OP_LB || inst.op == OP_LBU || inst.op == OP_SB) ? 1
+                    : (inst.op == OP_LH || inst.op == OP_LHU || inst.op == OP_SH) ? 2 : 4;
+                e.load(RAX, inst.rs1);
+                e.alu_imm(0, RAX, imm);
+                // Misaligned accesses are re-executed by the interpreter; the guard region catches the rest
+                if (align && width > 1) {
+                    e.u8(0xA9); e.u32(width - 1); // test eax, width - 1
+                    exits.push_back(std::make_pair(e.jcc(CC_NE), (uint32_t)k));
+                }
+
+                if (inst.op == OP_SB || inst.op == OP_SH || inst.op == OP_SW) {
+                    // Stores over code leave to the interpreter, which drops the code they hit;
+                    // the pages are marked dirty on the way, before the store
+                    e.rr(0x89, RAX, RCX);
+                    e.test_code(RCX);
+                    exits.push_back(std::make_pair(e.jcc(CC_NE), (uint32_t)k));
+                    e.mark_dirty_page(RCX);
+                    if (!align && width > 1) {
+                        e.u8(0x8D); e.u8(0x48); e.u8(width - 1); // lea ecx, [rax + width - 1], may straddle a page
+                        e.test_code(RCX);
+                        exits.push_back(std::make_pair(e.jcc(CC_NE), (uint32_t)k));
+                        e.mark_dirty_page(RCX);
+                    }
+                    e.load(RCX, inst.rs2);
+                    if (width == 2) e.u8(0x66);
+                    e.u8(width == 1 ? 0x88 : 0x89); e.u8(0x0C); e.u8(0x06); // mov [rsi + rax], cl/cx/ecx
+                } else {
+                    if (inst.op == OP_LW) {
+                        e.u8(0x8B); // mov ecx, [rsi + rax]
+                    } else {
+                        e.u8(0x0F); // movsx/movzx ecx, [rsi + rax]
+                        e.u8(inst.op == OP_LB ? 0xBE : inst.op == OP_LBU ? 0xB6 : inst.op == OP_LH ? 0xBF : 0xB7);
+                    }
+                    e.u8(0x0C); e.u8(0x06);
+                    e.store(RCX, inst.rd);
+                }
+            } break;
+
+            case OP_ADDI: case OP_XORI: case OP_ORI: case OP_ANDI: {
+                int digit = (inst.op == OP_ADDI) ? 0 : (inst.op == OP_XORI) ? 6 : (inst.op == OP_ORI) ? 1 : 4;
+                e.load(RAX, inst.rs1);
+                e.alu_imm(digit, RAX, imm);
+                e.store(RAX, inst.rd);
+            } break;
+            case OP_SLTI: case OP_SLTIU: {
+                e.load(RAX, inst.rs1);
+                e.alu_imm(7, RAX, imm);
+                e.setcc_eax(inst.op == OP_SLTI ? CC_L : CC_B);
+                e.store(RAX, inst.rd);
+            } break;
+            case OP_SLLI: case OP_SRLI: case OP_SRAI: {
+                int digit = (inst.op == OP_SLLI) ? 4 : (inst.op == OP_SRLI) ? 5 : 7;
+                e.load(RAX, inst.rs1);
+                e.shift_imm(digit, RAX, imm & 0x1F);
+                e.store(RAX, inst.rd);
+            } break;
+
+            case OP_SLL: case OP_SRL: case OP_SRA: {
+                int digit = (inst.op == OP_SLL) ? 4 : (inst.op == OP_SRL) ? 5 : 7;
+                e.load(RAX, inst.rs1);
+                e.load(RCX, inst.rs2);
+                e.shift_cl(digit, RAX); // x86 masks the count to 5 bits as well
+                e.store(RAX, inst.rd);
+            } break;
+            case OP_SLT: case OP_SLTU: {
+                e.load(RAX, inst.rs1);
+                e.load(RCX, inst.rs2);
+                e.rr(0x39, RCX, RAX);
+                e.setcc_eax(inst.op == OP_SLT ? CC_L : CC_B);
+                e.store(RAX, inst.rd);
+            } break;
+            case OP_ADD: case OP_SUB: case OP_XOR: case OP_OR: case OP_AND: {
+                uint8_t op = (inst.op == OP_ADD) ? 0x01 : (inst.op == OP_SUB) ? 0x29
+                    : (inst.op == OP_XOR) ? 0x31 : (inst.op == OP_OR) ? 0x09 : 0x21;
+                e.load(RAX, inst.rs1);
+                e.load(RCX, inst.rs2);
+                e.rr(op, RCX, RAX);
+                e.store(RAX, inst.rd);
+            } break;
+
+            case OP_FENCE: {
+                e.u8(0x0F); e.u8(0xAE); e.u8(0xF0); // mfence
+            } break;
+            case OP_MUL: {
+                e.load(RAX, inst.rs1);
+                e.load(RCX, inst.rs2);
+                e.u8(0x0F); e.u8(0xAF); e.u8(0xC1); // imul eax, ecx
+                e.store(RAX, inst.rd);
+            } break;
+            case OP_MULH: case OP_MULHSU: case OP_MULHU: {
+                // 64-bit product of the extended operands in rax, which leaves rdx alone
+                e.load(RAX, inst.rs1);
+                e.load(RCX, inst.rs2);
+                if (inst.op != OP_MULHU) { e.u8(0x48); e.u8(0x63); e.u8(0xC0); } // movsxd rax, eax
+                if (inst.op == OP_MULH) { e.u8(0x48); e.u8(0x63); e.u8(0xC9); } // movsxd rcx, ecx
+                e.u8(0x48); e.u8(0x0F); e.u8(0xAF); e.u8(0xC1); // imul rax, rcx
+                e.u8(0x48); e.u8(0xC1); e.u8(0xE8); e.u8(32);   // shr rax, 32
+                e.store(RAX, inst.rd);
+            } break;
+            case OP_DIV: case OP_DIVU: case OP_REM: case OP_REMU: {
+                bool is_signed = inst.op == OP_DIV || inst.op == OP_REM;
+                bool is_rem = inst.op == OP_REM || inst.op == OP_REMU;
+                e.load(RAX, inst.rs1);
+                e.load(RCX, inst.rs2);
+                e.rr(0x85, RCX, RCX);
+                size_t by_zero = e.jcc(CC_E);
+                size_t overflow = 0, not_overflow = 0;
+                if (is_signed) {
+                    e.alu_imm(7, RCX, 0xFFFFFFFF);
+                    not_overflow = e.jcc(CC_NE);
+                    e.alu_imm(7, RAX, 0x80000000);
+                    overflow = e.jcc(CC_E); // quotient is rs1 itself, remainder 0
+                    e.bind(not_overflow);
+                }
+                // rdx holds the pc_next pointer across the division
+                e.push(RDX);
+                if (is_signed) e.u8(0x99); // cdq
+                else e.rr(0x31, RDX, RDX);
+                e.u8(0xF7); e.u8(is_signed ? 0xF9 : 0xF1); // idiv/div ecx
+                if (is_rem) e.rr(0x89, RDX, RAX);
+                e.pop(RDX);
+                size_t done = e.jmp();
+                e.bind(by_zero);
+                if (!is_rem) e.mov_imm(RAX, 0xFFFFFFFF); // remainder is rs1 itself
+                size_t done_zero = e.jmp();
+                if (is_signed) {
+                    e.bind(overflow);
+                    if (is_rem) e.rr(0x31, RAX, RAX);
+                }
+                e.bind(done);
+                e.bind(done_zero);
+                e.store(RAX, inst.rd);
+            } break;
+            default: break;
+        }
+    }
+
+    // Normal exit, then the side exits into the interpreter
+    starts.push_back(e.size());
+    e.mov_imm(RAX, count);
+    size_t epilogue = e.size();
+    for (int i = 1; i < 32; i++) {
+        if (e.host[i] >= 0 && written[i]) e.rdi_mem(0x89, e.host[i], REG_DISP(i));
+    }
+    for (int i = saved_count - 1; i >= 0; i--) e.pop(saved_regs[i]);
+    e.ret();
+    for (size_t i = 0; i < exits.size(); i++) {
+        e.bind(exits[i].first);
+        e.mov_imm(RAX, exits[i].second);
+        e.bind_to(e.jmp(), epilogue);
+    }
+
+    if (e.overflow()) return;
+    block->jit_starts.swap(starts);
+    for (int i = 0; i < 32; i++) block->jit_host[i] = e.host[i];
+    block->jit_code = (JitCode32)(code_buf + code_used);
+    code_used += (e.size() + 15) & ~(size_t)15;
+#endif
+}
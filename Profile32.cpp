@@ -0,0 +1,99 @@
+#include "RISCV32.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+RISCV32::Profile32::Profile32(const std::vector<Symbol32>& symbols) : symbols(symbols), samples(0), dropped_calls(0) {
+}
+
+void RISCV32::Profile32::sample(uint32_t pc, uint32_t block_pc) {
+    samples++;
+    pc_samples[pc]++;
+    block_samples[block_pc]++;
+    calls.push_back(pc);
+    stack_samples[calls]++;
+    calls.pop_back();
+}
+
+void RISCV32::Profile32::call(uint32_t call_pc) {
+    if (calls.size() < PROFILE_MAX_DEPTH) calls.push_back(call_pc);
+    else dropped_calls++;
+}
+
+void RISCV32::Profile32::ret() {
+    if (dropped_calls > 0) dropped_calls--;
+    else if (!calls.empty()) calls.pop_back();
+}
+
+// Closest symbol at or below pc, nullptr without one
+const RISCV32::Symbol32* RISCV32::Profile32::lookup(uint32_t pc) const {
+    std::vector<Symbol32>::const_iterator it = std::upper_bound(symbols.begin(), symbols.end(), pc,
+        [](uint32_t addr, const Symbol32& sym) { return addr < sym.addr; });
+    if (it == symbols.begin()) return nullptr;
+    return &*(it - 1);
+}
+
+std::string RISCV32::Profile32::symbolize(uint32_t pc, bool offset) const {
+    char buf[16];
+    const Symbol32* sym = lookup(pc);
+    if (sym == nullptr) {
+        snprintf(buf, sizeof(buf), "%08x", pc);
+        return buf;
+    }
+    if (!offset || pc == sym->addr) return sym->name;
+    snprintf(buf, sizeof(buf), "+0x%x", pc - sym->addr);
+    return sym->name + buf;
+}
+
+void RISCV32::Profile32::report() {
+    std::cout << "Profile" << std::endl;
+    std::cout << "--------------------" << std::endl;
+    std::cout << std::dec << samples << " samples, one every " << PROFILE_INTERVAL << " instructions" << std::endl;
+    if (samples == 0) return;
+
+    const std::unordered_map<uint32_t, uint64_t>* tables[2] = { &pc_samples, &block_samples };
+    const char* titles[2] = { "Hottest pcs", "Hottest blocks" };
+    char line[48];
+    for (int t = 0; t < 2; t++) {
+        std::vector<std::pair<uint64_t, uint32_t> > hot;
+        for (std::unordered_map<uint32_t, uint64_t>::const_iterator it = tables[t]->begin(); it != tables[t]->end(); it++) {
+            hot.push_back(std::make_pair(it->second, it->first));
+        }
+        // Most samples first, lower addresses first among equals
+        std::sort(hot.begin(), hot.end(), [](const std::pair<uint64_t, uint32_t>& a, const std::pair<uint64_t, uint32_t>& b) {
+            return a.first != b.first ? a.first > b.first : a.second < b.second;
+        });
+        std::cout << titles[t] << std::endl;
+        std::cout << "   Samples       % | Address" << std::endl;
+        for (size_t i = 0; i < hot.size() && i < PROFILE_REPORT_LINES; i++) {
+            snprintf(line, sizeof(line), "%10llu %6.2f%% | %08x ", (unsigned long long)hot[i].first, 100.0 * hot[i].first / samples, hot[i].second);
+            std::cout << line << (lookup(hot[i].second) != nullptr ? symbolize(hot[i].second, true) : "") << std::endl;
+        }
+    }
+}
+
+// One line per distinct stack of functions, outermost first, as flamegraph tools read them
+void RISCV32::Profile32::write_folded(const std::string& path) {
+    std::map<std::string, uint64_t> folded;
+    for (std::map<std::vector<uint32_t>, uint64_t>::const_iterator it = stack_samples.begin(); it != stack_samples.end(); it++) {
+        std::string frames;
+        for (size_t i = 0; i < it->first.size(); i++) {
+            if (i > 0) frames += ';';
+            frames += symbolize(it->first[i], false);
+        }
+        folded[frames] += it->second;
+    }
+    std::string out;
+    for (std::map<std::string, uint64_t>::const_iterator it = folded.begin(); it != folded.end(); it++) {
+        out += it->first + ' ' + std::to_string(it->second) + '\n';
+    }
+    FILE* file = fopen(path.c_str(), "wb");
+    if (file == nullptr) {
+        throw std::runtime_error("Failed to open folded stack file.");
+    }
+    fwrite(out.data(), 1, out.size(), file);
+    fclose(file);
+}
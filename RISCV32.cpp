@@ -1,75 +1,298 @@
 #include "RISCV32.h"
+#include <algorithm>
+#include <cfenv>
+#include <cmath>
 #include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <iterator>
+#include <limits>
 #include <string>
 
-#include <fstream>
-
-// Global Variables
-int RISCV32::mem_access_align;
-int RISCV32::debug_mode;
-uint32_t RISCV32::pc;
-uint32_t RISCV32::pc_next;
-uint32_t RISCV32::reg32[32];
-uint8_t RISCV32::Memory32::mem[MEM_SIZE]; // Initialized all to 0
-
-// bool RISCV32::ext_M32::extended;
-// bool RISCV32::ext_A32::extended;
-// bool RISCV32::ext_F32::extended;
+#include <elf.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+// Fault recovery point of the hart running on this thread, and what the last fault was
+static thread_local sigjmp_buf* fault_jmp = nullptr;
+static thread_local uint8_t* fault_mem = nullptr;
+static thread_local uint8_t fault_kind;
+static thread_local uint64_t fault_tval;
+static thread_local uint64_t fault_host_regs[16]; // host registers of a fault in translated code
+static thread_local uint64_t fault_host_pc;       // 0 unless the fault came from translated code
+
+static const char* fault_message(uint8_t kind) {
+    switch (kind) {
+        case RISCV32::FAULT_ILLEGAL: return "Invalid instruction";
+        case RISCV32::FAULT_MISALIGNED: return "Unaligned memory access";
+        case RISCV32::FAULT_MISALIGNED_JUMP: return "Misaligned jump target";
+        default: return "Memory out of bounds";
+    }
+}
 
 RISCV32::RISCV32(
-    bool mem_access, bool debug, bool M, bool A, bool F,
+    bool jit, bool M, bool A, bool F, bool C, unsigned xlen,
     const char* program_file, uint32_t mem_start, uint32_t entrypoint
-    ) {
-    mem_access_align = mem_access;
-    // debug_mode = debug;
-    debug_mode = true;
-    // ext_M32::extend(M);
-    // ext_A32::extend(A);
-    // ext_F32::extend(F);
-
-    // Initialize program
-    Memory32::read_program(program_file);
+    ) : profile(symbols) {
+    jit_mode = jit;
+    ext.M = M;
+    ext.A = A;
+    ext.F = F;
+    ext.C = C;
+    this->xlen = (xlen == 64) ? 64 : 32;
+
+    // Initialize program, an ELF file brings its own entry point and XLEN
+    uint32_t elf_entry;
+    uint32_t image_end;
+    bool is_elf = memory.read_program(program_file, &elf_entry, &this->xlen, &image_end, &symbols);
+    sys = std::make_shared<Syscall32>(image_end);
+    // mem_start_addr = mem_start;
+    init_hart(0, is_elf ? elf_entry : entrypoint);
+}
+
+RISCV32::RISCV32(RISCV32* boot, uint32_t id) : symbols(boot->symbols), profile(symbols), memory(&boot->memory), sys(boot->sys) {
+    jit_mode = boot->jit_mode;
+    ext = boot->ext;
+    xlen = boot->xlen;
+    init_hart(id, boot->pc);
+}
+
+void RISCV32::init_hart(uint32_t id, uint32_t entry) {
+    hartid = id;
+    memory.attach_code(this, id);
+    code_stores_seen = memory.code_stores_elsewhere();
+    decode_cache.resize(DECODE_CACHE_SIZE);
+    for (int i = 0; i < DECODE_CACHE_SIZE; i++) {
+        decode_cache[i].pc = 0xFFFFFFFF;
+    }
+    for (int i = 0; i < 32; i++) {
+        xreg[i] = 0;
+        freg32[i] = 0;
+    }
+    frm = FRM_RNE;
+    fflags = 0;
+    xreg[2] = MEM_SIZE - 16 - (uint64_t)id * HART_STACK_SIZE; // stack pointer at the largest (aligned) address
+    xreg[10] = id; // a0 holds the hart id, as boot firmware passes it
+    instret = 0;
+    counters = Counters32();
+    stop_pc = 0xFFFFFFFF;
+    profiling = false;
+    next_sample = UINT64_MAX;
+    snapshot.valid = false;
+    reservation_valid = false;
+    trap = Trap32();
+    trap.mstatus = MSTATUS_MPP;
+    idle = 0;
+    reset_events();
+    current = nullptr;
+    executing = nullptr;
     
     // Status
     running = false;
 
-    // mem_start_addr = mem_start;
-    pc = entrypoint;
+    pc = entry;
     pc_next = pc + 4;
 }
 
+template <class Cfg>
 void RISCV32::run() {
+    if (Cfg::xlen != xlen) {
+        throw std::runtime_error("Core does not match the XLEN of the hart.");
+    }
     running = true;
-    reg32[0] = 0;
-    reg32[2] = MEM_SIZE - 1; // stack pointer at the largest address
+    xreg[0] = 0;
+    if (ext.F) std::feclearexcept(FE_ALL_EXCEPT); // host flags raised from here on are the guest's
+
+    // Traced runs hand their records to the writer thread, which is done when run returns
+    struct TraceScope {
+        Trace32& trace;
+        TraceScope(Trace32& trace) : trace(trace) { if (Cfg::debug) trace.start(Cfg::xlen); }
+        ~TraceScope() { if (Cfg::debug) trace.stop(); }
+    } trace_scope(trace);
+
+    // Guest console output is written out however the run ends
+    struct ConsoleScope {
+        Syscall32& sys;
+        ConsoleScope(Syscall32& sys) : sys(sys) {}
+        ~ConsoleScope() { sys.flush(); }
+    } console_scope(*sys);
+
+    // Guest faults, and accesses that hit the guard region or read-only pages, land here
+    sigjmp_buf fault;
+    Memory32::FaultScope scope(memory, &fault);
+    current = nullptr;
+    executing = nullptr;
+    if (sigsetjmp(fault, 0) != 0) {
+        const Decoded32* inst = executing;
+        if (inst == nullptr && current != nullptr) inst = jit.locate_fault(*this, current, fault_host_regs, fault_host_pc);
+        executing = nullptr;
+        if (inst == nullptr || !take_fault<Cfg>(*inst)) {
+            if (ext.F) sync_fflags();
+            running = false;
+            throw std::runtime_error(fault_message(fault_kind));
+        }
+    }
 
-    while (running && pc < 0x100000) {
-        pc_next = pc + 4;
+    // pc only advances at block boundaries; handlers see their own pc in the decoded record
+    Block32* block = lookup_block<Cfg>(pc);
+    while (true) {
+        pc_next = block->end_pc;
+        current = block;
         
-        uint32_t instr;
-        Memory32::read_mem_u32(pc, &instr);
-
-        if (instr == 0x00000000) { // noop
-            running = false;
+        const Decoded32* inst = block->insts.data();
+        const Decoded32* end = inst + block->insts.size();
+        if (block->jit_code != nullptr) {
+            inst += jit.enter(*this, block); // the interpreter finishes what host code left
+        } else if (!Cfg::debug && Cfg::xlen == 32 && jit_mode == 1 && ++block->exec_count == JIT_THRESHOLD) {
+            jit.compile(*this, block, Cfg::align); // translated blocks do not trace, RV64 is interpreted
+        }
+        for (; inst != end; inst++) {
+            executing = inst;
+            if (Cfg::debug) execute_traced<Cfg>(*inst);
+            else inst->handler(*this, *inst);
+        }
+        executing = nullptr;
+        instret += block->retired;
+        if (profiling) profile_block(block);
+        counters.loads += block->loads;
+        counters.stores += block->stores;
+        counters.fused_pairs += block->fused;
+        if (block->cond_branch && pc_next != block->end_pc) counters.taken_branches++;
+
+        if (block->halt) { // noop
+            pc = block->end_pc;
             break;
         }
         
-        execute32(instr);
         pc = pc_next;
+        if (instret >= next_event) service_events(); // may take an interrupt
+        if (pc == stop_pc || sys->exited.load(std::memory_order_relaxed)) break;
+        block = chain_block<Cfg>(block);
+    }
+    if (ext.F) sync_fflags();
+    running = false;
+}
+
+template <class Cfg>
+void RISCV32::execute_traced(const Decoded32& inst) {
+    Trace32::Record rec;
+    rec.pc = inst.pc;
+    uint16_t parcel;
+    fetch_instr<Cfg>(inst.pc, &rec.instr, &parcel);
+    rec.parcel = parcel;
+    bool amo = inst.op >= OP_LR_W && inst.op <= OP_AMOMAXU_W;
+    rec.mem_addr = xreg[inst.rs1] + (amo ? 0 : (int32_t)inst.imm); // the immediate of an amo holds aq and rl
+    rec.mem_value = (inst.op == OP_FSW) ? freg32[inst.rs2] : read_x<Cfg>(inst.rs2);
+    inst.handler(*this, inst); // a faulting instruction does not retire and is not traced
+    rec.rd_value = writes_freg(inst.op) ? freg32[inst.rd] : xreg[inst.rd];
+    bool load = (inst.op >= OP_LB && inst.op <= OP_LHU) || inst.op == OP_LWU || inst.op == OP_LD;
+    if (load || inst.op == OP_FLW || inst.op == OP_LR_W) rec.mem_value = rec.rd_value;
+    trace.push(rec);
+}
+
+// Pages that may differ from zero: the loaded program, everything written and the snapshot
+void RISCV32::modified_pages(std::vector<uint32_t>* pages) {
+    std::vector<uint32_t> written;
+    memory.dirty_pages(&written, false);
+    if (!snapshot.valid) {
+        pages->swap(written);
+        return;
+    }
+    std::set_union(snapshot.memory.pages.begin(), snapshot.memory.pages.end(), written.begin(), written.end(), std::back_inserter(*pages));
+}
+
+void RISCV32::print_mem_modified() {
+    std::vector<uint32_t> pages;
+    modified_pages(&pages);
+    memory.print_pages(pages);
+}
+
+void RISCV32::write_mem_image(const std::string& path, bool hex) {
+    std::vector<uint32_t> pages;
+    modified_pages(&pages);
+    memory.write_image(path, pages, hex);
+}
+
+void RISCV32::enable_profile() {
+    profiling = true;
+    next_sample = instret + PROFILE_INTERVAL;
+}
+
+// Samples the instruction that crossed the sampling point and follows calls and returns
+void RISCV32::profile_block(const Block32* block) {
+    profile_samples(block, block->retired);
+    if (block->link == LINK_CALL) profile.call(block->insts.back().pc);
+    else if (block->link == LINK_RETURN) profile.ret();
+}
+
+// The block retired its first instructions, the last of them just added to instret
+void RISCV32::profile_samples(const Block32* block, uint64_t retired) {
+    uint64_t before = instret - retired;
+    while (instret >= next_sample) {
+        // Record of the sampled instruction, a fused pair stands for both of its own
+        uint64_t n = next_sample - before;
+        size_t k = 0;
+        while (n > block->insts[k].count) n -= block->insts[k++].count;
+        profile.sample(block->insts[k].pc, block->insts[0].pc);
+        next_sample += PROFILE_INTERVAL;
     }
+}
 
-    std::cout << "Program Ends." << std::endl;
-    RISCV32::
-    RISCV32::Memory32::print_mem_all();
+void RISCV32::save_snapshot() {
+    snapshot.pc = pc;
+    std::memcpy(snapshot.xreg, xreg, sizeof(xreg));
+    std::memcpy(snapshot.freg32, freg32, sizeof(freg32));
+    sync_fflags();
+    snapshot.frm = frm;
+    snapshot.fflags = fflags;
+    snapshot.instret = instret;
+    snapshot.idle = idle;
+    snapshot.trap = trap;
+    snapshot.counters = counters;
+    sys->save(&snapshot.sys);
+    memory.save(&snapshot.memory);
+    snapshot.valid = true;
 }
 
+void RISCV32::restore_snapshot() {
+    if (!snapshot.valid) {
+        throw std::runtime_error("No snapshot to restore.");
+    }
+    pc = snapshot.pc;
+    pc_next = pc + 4;
+    std::memcpy(xreg, snapshot.xreg, sizeof(xreg));
+    std::memcpy(freg32, snapshot.freg32, sizeof(freg32));
+    frm = snapshot.frm;
+    fflags = snapshot.fflags;
+    std::feclearexcept(FE_ALL_EXCEPT);
+    instret = snapshot.instret;
+    idle = snapshot.idle;
+    trap = snapshot.trap;
+    counters = snapshot.counters;
+    sys->restore(snapshot.sys);
+    memory.restore(snapshot.memory);
+    reset_events();
+}
+
+// One fully specialized core per configuration, selected in main.cpp
+template void RISCV32::run<RISCV32::Config32<false, false> >();
+template void RISCV32::run<RISCV32::Config32<false, true> >();
+template void RISCV32::run<RISCV32::Config32<true, false> >();
+template void RISCV32::run<RISCV32::Config32<true, true> >();
+template void RISCV32::run<RISCV32::Config64<false, false> >();
+template void RISCV32::run<RISCV32::Config64<false, true> >();
+template void RISCV32::run<RISCV32::Config64<true, false> >();
+template void RISCV32::run<RISCV32::Config64<true, true> >();
+
 void RISCV32::print_inst(uint32_t pc, std::string msg) {
-    if (RISCV32::debug_mode == 0) return;
     std::cout << "pc: ";
     std::cout.width(8);
     std::cout.fill('0');
-    std::cout << std::hex << pc << ": " << msg << std::endl;
+    std::cout << std::hex << pc << ": " << msg << '\n';
 }
 
 void RISCV32::print_reg_all() {
@@ -79,9 +302,9 @@ void RISCV32::print_reg_all() {
         std::cout << "x[";
         std::cout.width(2);
         std::cout << std::hex << i << "] = ";
-        std::cout.width(8);
+        std::cout.width(xlen / 4);
         std::cout.fill('0');
-        std::cout << std::hex << RISCV32::reg32[i] << std::endl;
+        std::cout << std::hex << xreg[i] << std::endl;
     }
 }
 
@@ -106,17 +329,19 @@ uint32_t RISCV32::imm_gen(uint32_t instr) {
         case 0x63: {
             return ((instr_s >> 19) & 0xFFFFF000) | ((instr << 4) & 0x00000800) | ((instr >> 20) & 0x000007E0) | ((instr >> 7) & 0x0000001E); 
         } break;
-        case 0x03: {
+        case 0x03:
+        case 0x07: {
             return ((instr_s >> 20) & 0xFFFFF000) | ((instr >> 20) & 0x00000FFF);
         } break;
-        case 0x23: {
+        case 0x23:
+        case 0x27: {
             return ((instr_s >> 20) & 0xFFFFF000) | ((instr >> 20) & 0x00000FE0) | ((instr >> 7) & 0x000001F);
         } break;
         case 0x13: {
             switch (funct3) {
                 case 0x1:
                 case 0x5: {
-                    return (instr >> 20) & 0x1F;
+                    return (instr >> 20) & 0x3F; // shamt[5] is only legal on RV64
                 } break;
                 case 0x0:
                 case 0x2:
@@ -129,59 +354,73 @@ uint32_t RISCV32::imm_gen(uint32_t instr) {
                 default: { return -1; } break;
             }
         } break;
+        case 0x1B: {
+            if (funct3 == 0x1 || funct3 == 0x5) return (instr >> 20) & 0x1F;
+            return ((instr_s >> 20) & 0xFFFFF000) | ((instr >> 20) & 0x00000FFF);
+        } break;
         case 0x33: {
             return -1;
         }
         default: {return -1;} break;
     }
 }
-void RISCV32::execute32(uint32_t instr) {
+void RISCV32::decode32(uint32_t instr, Decoded32* inst) {
     uint32_t opcode = instr & 0x7F;
-    uint32_t rd = (instr >> 7) & 0x1F;
-    uint32_t rs1 = (instr >> 15) & 0x1F;
-    uint32_t rs2 = (instr >> 20) & 0x1F;
     uint32_t funct3 = (instr >> 12) & 0x7;
     uint32_t funct7 = (instr >> 25) & 0x7F;
 
+    inst->rd = (instr >> 7) & 0x1F;
+    inst->rs1 = (instr >> 15) & 0x1F;
+    inst->rs2 = (instr >> 20) & 0x1F;
+    inst->rs3 = instr >> 27;
+    inst->rm = funct3;
+    inst->imm = imm_gen(instr);
+    inst->op = OP_UNKNOWN;
+
+    if (instr == 0x00000000) { // noop, terminates the program
+        inst->op = OP_HALT;
+        return;
+    }
+
     switch (opcode) {
         case 0x37: {
-            base_I32::lui(rd, imm_gen(instr));
+            inst->op = OP_LUI;
         } break;
 
         case 0x17: {
-            base_I32::auipc(rd, imm_gen(instr));
+            inst->op = OP_AUIPC;
         } break;
 
         case 0x6F: {
-            base_I32::jal(rd, imm_gen(instr));
+            inst->op = OP_JAL;
         } break;
 
         case 0x67: {
-            base_I32::jalr(rd, rs1, imm_gen(instr));
+            inst->op = OP_JALR;
         } break;
 
         case 0x63: {
             switch (funct3) {
                 case 0x0: {
-                    base_I32::beq(rs1, rs2, imm_gen(instr));
+                    inst->op = OP_BEQ;
                 } break;
                 case 0x1: {
-                    base_I32::bne(rs1, rs2, imm_gen(instr));
+                    inst->op = OP_BNE;
                 } break;
                 case 0x4: {
-                    base_I32::blt(rs1, rs2, imm_gen(instr));
+                    inst->op = OP_BLT;
                 } break;
                 case 0x5: {
-                    base_I32::bge(rs1, rs2, imm_gen(instr));
+                    inst->op = OP_BGE;
                 } break;
                 case 0x6: {
-                    base_I32::bltu(rs1, rs2, imm_gen(instr));
+                    inst->op = OP_BLTU;
                 } break;
                 case 0x7: {
-                    base_I32::bgeu(rs1, rs2, imm_gen(instr));
+                    inst->op = OP_BGEU;
                 } break;
                 default: {
-                    INSTR_ERR;
+                    inst->op = OP_ILLEGAL;
                 } break;
             }
         } break;
@@ -189,22 +428,28 @@ void RISCV32::execute32(uint32_t instr) {
         case 0x03: {
             switch (funct3) {
                 case 0x0: {
-                    base_I32::lb(rd, rs1, imm_gen(instr));
+                    inst->op = OP_LB;
                 } break;
                 case 0x1: {
-                    base_I32::lh(rd, rs1, imm_gen(instr));
+                    inst->op = OP_LH;
                 } break;
                 case 0x2: {
-                    base_I32::lw(rd, rs1, imm_gen(instr));
+                    inst->op = OP_LW;
                 } break;
                 case 0x4: {
-                    base_I32::lbu(rd, rs1, imm_gen(instr));
+                    inst->op = OP_LBU;
                 } break;
                 case 0x5: {
-                    base_I32::lhu(rd, rs1, imm_gen(instr));
+                    inst->op = OP_LHU;
+                } break;
+                case 0x6: {
+                    inst->op = OP_LWU;
+                } break;
+                case 0x3: {
+                    inst->op = OP_LD;
                 } break;
                 default: {
-                    INSTR_ERR;
+                    inst->op = OP_ILLEGAL;
                 } break;
             }
         } break;
@@ -212,16 +457,19 @@ void RISCV32::execute32(uint32_t instr) {
         case 0x23: {
             switch (funct3) {
                 case 0x0: {
-                    base_I32::sb(rs1, rs2, imm_gen(instr));
+                    inst->op = OP_SB;
                 } break;
                 case 0x1: {
-                    base_I32::sh(rs1, rs2, imm_gen(instr));
+                    inst->op = OP_SH;
                 } break;
                 case 0x2: {
-                    base_I32::sw(rs1, rs2, imm_gen(instr));
+                    inst->op = OP_SW;
+                } break;
+                case 0x3: {
+                    inst->op = OP_SD;
                 } break;
                 default: {
-                    INSTR_ERR;
+                    inst->op = OP_ILLEGAL;
                 } break;
             }
         } break;
@@ -229,93 +477,317 @@ void RISCV32::execute32(uint32_t instr) {
         case 0x13: {
             switch (funct3) {
                 case 0x0: {
-                    base_I32::addi(rd, rs1, imm_gen(instr));
+                    inst->op = OP_ADDI;
                 } break;
                 case 0x2: {
-                    base_I32::slti(rd, rs1, imm_gen(instr));
+                    inst->op = OP_SLTI;
                 } break;
                 case 0x3: {
-                    base_I32::sltiu(rd, rs1, imm_gen(instr));
+                    inst->op = OP_SLTIU;
                 } break;
                 case 0x4: {
-                    base_I32::xori(rd, rs1, imm_gen(instr));
+                    inst->op = OP_XORI;
                 } break;
                 case 0x6: {
-                    base_I32::ori(rd, rs1, imm_gen(instr));
+                    inst->op = OP_ORI;
                 } break;
                 case 0x7: {
-                    base_I32::andi(rd, rs1, imm_gen(instr));
+                    inst->op = OP_ANDI;
                 } break;
                 case 0x1: {
-                    base_I32::slli(rd, rs1, imm_gen(instr));
+                    inst->op = (funct7 >> 1 == 0x00) ? OP_SLLI : OP_ILLEGAL;
                 } break;
                 case 0x5: {
-                    switch (funct7) {
+                    switch (funct7 >> 1) { // funct6, the low bit is shamt[5]
                         case 0x00: {
-                            base_I32::srli(rd, rs1, imm_gen(instr));
+                            inst->op = OP_SRLI;
                         } break;
-                        case 0x20: {
-                            base_I32::srai(rd, rs1, imm_gen(instr));
+                        case 0x10: {
+                            inst->op = OP_SRAI;
                         } break;
                         default: {
-                            INSTR_ERR;
+                            inst->op = OP_ILLEGAL;
                         } break;
                     }
                 } break;
                 default: {
-                    INSTR_ERR;
+                    inst->op = OP_ILLEGAL;
                 } break;
             }
         } break;
         
         case 0x33: {
+            if (funct7 == 0x01) { // RV32M
+                switch (funct3) {
+                    case 0x0: {
+                        inst->op = OP_MUL;
+                    } break;
+                    case 0x1: {
+                        inst->op = OP_MULH;
+                    } break;
+                    case 0x2: {
+                        inst->op = OP_MULHSU;
+                    } break;
+                    case 0x3: {
+                        inst->op = OP_MULHU;
+                    } break;
+                    case 0x4: {
+                        inst->op = OP_DIV;
+                    } break;
+                    case 0x5: {
+                        inst->op = OP_DIVU;
+                    } break;
+                    case 0x6: {
+                        inst->op = OP_REM;
+                    } break;
+                    case 0x7: {
+                        inst->op = OP_REMU;
+                    } break;
+                }
+                break;
+            }
             switch (funct3) {
                 case 0x0: {
                     switch (funct7) {
                         case 0x00: {
-                            base_I32::add(rd, rs1, rs2);
+                            inst->op = OP_ADD;
                         } break;
                         case 0x20: {
-                            base_I32::sub(rd, rs1, rs2);
+                            inst->op = OP_SUB;
                         } break;
                         default: {
-                            INSTR_ERR;
+                            inst->op = OP_ILLEGAL;
                         } break;
                     }
                 } break;
                 case 0x1: {
-                    base_I32::sll(rd, rs1, rs2);
+                    inst->op = OP_SLL;
                 } break;
                 case 0x2: {
-                    base_I32::slt(rd, rs1, rs2);
+                    inst->op = OP_SLT;
                 } break;
                 case 0x3: {
-                    base_I32::sltu(rd, rs1, rs2);
+                    inst->op = OP_SLTU;
                 } break;
                 case 0x4: {
-                    base_I32::xor_(rd, rs1, rs2);
+                    inst->op = OP_XOR;
                 } break;
                 case 0x5: {
                     switch (funct7) {
                         case 0x00: {
-                            base_I32::srl(rd, rs1, rs2);
+                            inst->op = OP_SRL;
                         } break;
                         case 0x20: {
-                            base_I32::sra(rd, rs1, rs2);
+                            inst->op = OP_SRA;
                         } break;
                         default: {
-                            INSTR_ERR;
+                            inst->op = OP_ILLEGAL;
                         } break;
                     }
                 } break;
                 case 0x6: {
-                    base_I32::or_(rd, rs1, rs2);
+                    inst->op = OP_OR;
                 } break;
                 case 0x7: {
-                    base_I32::and_(rd, rs1, rs2);
+                    inst->op = OP_AND;
+                } break;
+                default: {
+                    inst->op = OP_ILLEGAL;
+                } break;
+            }
+        } break;
+
+        case 0x1B: {
+            switch (funct3) {
+                case 0x0: {
+                    inst->op = OP_ADDIW;
+                } break;
+                case 0x1: {
+                    inst->op = (funct7 == 0x00) ? OP_SLLIW : OP_ILLEGAL;
+                } break;
+                case 0x5: {
+                    inst->op = (funct7 == 0x00) ? OP_SRLIW : (funct7 == 0x20) ? OP_SRAIW : OP_ILLEGAL;
+                } break;
+                default: {
+                    inst->op = OP_ILLEGAL;
+                } break;
+            }
+        } break;
+
+        case 0x3B: {
+            if (funct7 == 0x01) { // RV64M
+                switch (funct3) {
+                    case 0x0: {
+                        inst->op = OP_MULW;
+                    } break;
+                    case 0x4: {
+                        inst->op = OP_DIVW;
+                    } break;
+                    case 0x5: {
+                        inst->op = OP_DIVUW;
+                    } break;
+                    case 0x6: {
+                        inst->op = OP_REMW;
+                    } break;
+                    case 0x7: {
+                        inst->op = OP_REMUW;
+                    } break;
+                    default: {
+                        inst->op = OP_ILLEGAL;
+                    } break;
+                }
+                break;
+            }
+            switch (funct3) {
+                case 0x0: {
+                    inst->op = (funct7 == 0x00) ? OP_ADDW : (funct7 == 0x20) ? OP_SUBW : OP_ILLEGAL;
+                } break;
+                case 0x1: {
+                    inst->op = (funct7 == 0x00) ? OP_SLLW : OP_ILLEGAL;
+                } break;
+                case 0x5: {
+                    inst->op = (funct7 == 0x00) ? OP_SRLW : (funct7 == 0x20) ? OP_SRAW : OP_ILLEGAL;
+                } break;
+                default: {
+                    inst->op = OP_ILLEGAL;
+                } break;
+            }
+        } break;
+
+        case 0x0F: {
+            if (funct3 == 0x0) inst->op = OP_FENCE;
+            else if (funct3 == 0x1) inst->op = OP_FENCE_I;
+        } break;
+
+        case 0x2F: {
+            inst->imm = (instr >> 25) & 0x3; // aq, rl
+            if (funct3 != 0x2) {
+                inst->op = OP_ILLEGAL;
+                break;
+            }
+            switch (funct7 >> 2) {
+                case 0x02: {
+                    inst->op = (inst->rs2 == 0) ? OP_LR_W : OP_ILLEGAL;
+                } break;
+                case 0x03: {
+                    inst->op = OP_SC_W;
+                } break;
+                case 0x01: {
+                    inst->op = OP_AMOSWAP_W;
+                } break;
+                case 0x00: {
+                    inst->op = OP_AMOADD_W;
+                } break;
+                case 0x04: {
+                    inst->op = OP_AMOXOR_W;
+                } break;
+                case 0x0C: {
+                    inst->op = OP_AMOAND_W;
+                } break;
+                case 0x08: {
+                    inst->op = OP_AMOOR_W;
+                } break;
+                case 0x10: {
+                    inst->op = OP_AMOMIN_W;
+                } break;
+                case 0x14: {
+                    inst->op = OP_AMOMAX_W;
+                } break;
+                case 0x18: {
+                    inst->op = OP_AMOMINU_W;
+                } break;
+                case 0x1C: {
+                    inst->op = OP_AMOMAXU_W;
                 } break;
                 default: {
-                    INSTR_ERR;
+                    inst->op = OP_ILLEGAL;
+                } break;
+            }
+        } break;
+
+        case 0x07: {
+            if (funct3 == 0x2) inst->op = OP_FLW;
+        } break;
+
+        case 0x27: {
+            if (funct3 == 0x2) inst->op = OP_FSW;
+        } break;
+
+        case 0x43:
+        case 0x47:
+        case 0x4B:
+        case 0x4F: {
+            if ((funct7 & 0x3) != 0x0) break; // only the single-precision format
+            inst->op = (opcode == 0x43) ? OP_FMADD_S : (opcode == 0x47) ? OP_FMSUB_S : (opcode == 0x4B) ? OP_FNMSUB_S : OP_FNMADD_S;
+        } break;
+
+        case 0x53: {
+            switch (funct7) {
+                case 0x00: {
+                    inst->op = OP_FADD_S;
+                } break;
+                case 0x04: {
+                    inst->op = OP_FSUB_S;
+                } break;
+                case 0x08: {
+                    inst->op = OP_FMUL_S;
+                } break;
+                case 0x0C: {
+                    inst->op = OP_FDIV_S;
+                } break;
+                case 0x2C: {
+                    inst->op = (inst->rs2 == 0) ? OP_FSQRT_S : OP_ILLEGAL;
+                } break;
+                case 0x10: {
+                    inst->op = (funct3 == 0x0) ? OP_FSGNJ_S : (funct3 == 0x1) ? OP_FSGNJN_S : (funct3 == 0x2) ? OP_FSGNJX_S : OP_ILLEGAL;
+                } break;
+                case 0x14: {
+                    inst->op = (funct3 == 0x0) ? OP_FMIN_S : (funct3 == 0x1) ? OP_FMAX_S : OP_ILLEGAL;
+                } break;
+                case 0x60: {
+                    inst->op = (inst->rs2 == 0) ? OP_FCVT_W_S : (inst->rs2 == 1) ? OP_FCVT_WU_S : OP_ILLEGAL;
+                } break;
+                case 0x70: {
+                    inst->op = (inst->rs2 != 0) ? OP_ILLEGAL : (funct3 == 0x0) ? OP_FMV_X_W : (funct3 == 0x1) ? OP_FCLASS_S : OP_ILLEGAL;
+                } break;
+                case 0x50: {
+                    inst->op = (funct3 == 0x2) ? OP_FEQ_S : (funct3 == 0x1) ? OP_FLT_S : (funct3 == 0x0) ? OP_FLE_S : OP_ILLEGAL;
+                } break;
+                case 0x68: {
+                    inst->op = (inst->rs2 == 0) ? OP_FCVT_S_W : (inst->rs2 == 1) ? OP_FCVT_S_WU : OP_ILLEGAL;
+                } break;
+                case 0x78: {
+                    inst->op = (inst->rs2 == 0 && funct3 == 0x0) ? OP_FMV_W_X : OP_ILLEGAL;
+                } break;
+                default: break; // other formats
+            }
+        } break;
+
+        case 0x73: {
+            inst->imm = instr >> 20; // csr, rs1 holds the immediate of the i forms
+            switch (funct3) {
+                case 0x1: {
+                    inst->op = OP_CSRRW;
+                } break;
+                case 0x2: {
+                    inst->op = OP_CSRRS;
+                } break;
+                case 0x3: {
+                    inst->op = OP_CSRRC;
+                } break;
+                case 0x5: {
+                    inst->op = OP_CSRRWI;
+                } break;
+                case 0x6: {
+                    inst->op = OP_CSRRSI;
+                } break;
+                case 0x7: {
+                    inst->op = OP_CSRRCI;
+                } break;
+                case 0x0: {
+                    if (instr == 0x00000073) inst->op = OP_ECALL; // ebreak is skipped
+                    else if (instr == 0x30200073) inst->op = OP_MRET;
+                    else if (instr == 0x10500073) inst->op = OP_WFI;
                 } break;
             }
         } break;
@@ -323,399 +795,2300 @@ void RISCV32::execute32(uint32_t instr) {
     }
 }
 
-void RISCV32::Memory32::read_mem_u8(uint32_t addr, uint8_t* data) {
-    if (mem_access_align == 1 && addr % 1 != 0) {
-        MEM_ALIGN_ERR;
-    }
-    if (addr >= MEM_SIZE) {
-        MEM_OUT_ERR;
-    }
-    *data = mem[addr];
+// 32-bit encodings the RVC instructions expand to
+static uint32_t enc_r(uint32_t opcode, uint32_t funct3, uint32_t funct7, uint32_t rd, uint32_t rs1, uint32_t rs2) {
+    return (funct7 << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+}
+static uint32_t enc_i(uint32_t opcode, uint32_t funct3, uint32_t rd, uint32_t rs1, int32_t imm) {
+    return ((uint32_t)imm << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+}
+static uint32_t enc_s(uint32_t opcode, uint32_t funct3, uint32_t rs1, uint32_t rs2, int32_t imm) {
+    uint32_t u = (uint32_t)imm;
+    return ((u >> 5) << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | ((u & 0x1F) << 7) | opcode;
+}
+static uint32_t enc_b(uint32_t funct3, uint32_t rs1, uint32_t rs2, int32_t imm) {
+    uint32_t u = (uint32_t)imm;
+    return (((u >> 12) & 0x1) << 31) | (((u >> 5) & 0x3F) << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12)
+        | (((u >> 1) & 0xF) << 8) | (((u >> 11) & 0x1) << 7) | 0x63;
+}
+static uint32_t enc_j(uint32_t rd, int32_t imm) {
+    uint32_t u = (uint32_t)imm;
+    return (((u >> 20) & 0x1) << 31) | (((u >> 1) & 0x3FF) << 21) | (((u >> 11) & 0x1) << 20)
+        | (((u >> 12) & 0xFF) << 12) | (rd << 7) | 0x6F;
 }
 
-void RISCV32::Memory32::read_mem_u16(uint32_t addr, uint16_t* data) {
-    if (mem_access_align == 1 && addr % 2 != 0) {
-        MEM_ALIGN_ERR;
-    }
-    if (addr >= MEM_SIZE - 1) {
-        MEM_OUT_ERR;
-    }
-    *data = (mem[addr + 1] << 8) | mem[addr];
+// Bit b of c moved to position to
+static uint32_t cbit(uint16_t c, int b, int to) {
+    return ((c >> b) & 0x1) << to;
+}
+// Sign-extends the low bits bits of v
+static int32_t csext(uint32_t v, int bits) {
+    return (int32_t)(v << (32 - bits)) >> (32 - bits);
 }
 
-void RISCV32::Memory32::read_mem_u32(uint32_t addr, uint32_t* data) {
-    if (mem_access_align == 1 && addr % 4 != 0) {
-        MEM_ALIGN_ERR;
-    }
-    if (addr >= MEM_SIZE - 3) {
-        MEM_OUT_ERR;
+bool RISCV32::expand16(uint16_t c, unsigned xlen, uint32_t* instr) {
+    uint32_t funct3 = c >> 13;
+    uint32_t rd = (c >> 7) & 0x1F;        // also rs1 of the full-register forms
+    uint32_t rs2 = (c >> 2) & 0x1F;
+    uint32_t rd_p = 8 + ((c >> 2) & 0x7);  // rd' / rs2' of the compact forms
+    uint32_t rs1_p = 8 + ((c >> 7) & 0x7);
+    int32_t imm6 = csext(cbit(c, 12, 5) | ((c >> 2) & 0x1F), 6);
+    uint32_t shamt = cbit(c, 12, 5) | ((c >> 2) & 0x1F);
+    int32_t j_off = csext(cbit(c, 12, 11) | cbit(c, 11, 4) | cbit(c, 10, 9) | cbit(c, 9, 8) | cbit(c, 8, 10)
+        | cbit(c, 7, 6) | cbit(c, 6, 7) | cbit(c, 5, 3) | cbit(c, 4, 2) | cbit(c, 3, 1) | cbit(c, 2, 5), 12);
+    int32_t b_off = csext(cbit(c, 12, 8) | cbit(c, 11, 4) | cbit(c, 10, 3) | cbit(c, 6, 7) | cbit(c, 5, 6)
+        | cbit(c, 4, 2) | cbit(c, 3, 1) | cbit(c, 2, 5), 9);
+    // Scaled unsigned offsets of the word and double-word loads and stores
+    uint32_t w_off = cbit(c, 12, 5) | cbit(c, 11, 4) | cbit(c, 10, 3) | cbit(c, 6, 2) | cbit(c, 5, 6);
+    uint32_t d_off = cbit(c, 12, 5) | cbit(c, 11, 4) | cbit(c, 10, 3) | cbit(c, 6, 7) | cbit(c, 5, 6);
+    uint32_t wsp_load = cbit(c, 12, 5) | (((c >> 4) & 0x7) << 2) | (((c >> 2) & 0x3) << 6);
+    uint32_t dsp_load = cbit(c, 12, 5) | (((c >> 5) & 0x3) << 3) | (((c >> 2) & 0x7) << 6);
+    uint32_t wsp_store = (((c >> 9) & 0xF) << 2) | (((c >> 7) & 0x3) << 6);
+    uint32_t dsp_store = (((c >> 10) & 0x7) << 3) | (((c >> 7) & 0x7) << 6);
+
+    switch (((c & 0x3) << 3) | funct3) {
+        // Quadrant 0
+        case 0x00: { // c.addi4spn
+            uint32_t nzuimm = (((c >> 11) & 0x3) << 4) | (((c >> 7) & 0xF) << 6) | cbit(c, 6, 2) | cbit(c, 5, 3);
+            if (nzuimm == 0) return false;
+            *instr = enc_i(0x13, 0x0, rd_p, 2, nzuimm);
+        } break;
+        case 0x02: { // c.lw
+            *instr = enc_i(0x03, 0x2, rd_p, rs1_p, w_off);
+        } break;
+        case 0x03: { // c.flw, c.ld on RV64
+            if (xlen == 64) *instr = enc_i(0x03, 0x3, rd_p, rs1_p, d_off);
+            else *instr = enc_i(0x07, 0x2, rd_p, rs1_p, w_off);
+        } break;
+        case 0x06: { // c.sw
+            *instr = enc_s(0x23, 0x2, rs1_p, rd_p, w_off);
+        } break;
+        case 0x07: { // c.fsw, c.sd on RV64
+            if (xlen == 64) *instr = enc_s(0x23, 0x3, rs1_p, rd_p, d_off);
+            else *instr = enc_s(0x27, 0x2, rs1_p, rd_p, w_off);
+        } break;
+
+        // Quadrant 1
+        case 0x08: { // c.addi, c.nop
+            *instr = enc_i(0x13, 0x0, rd, rd, imm6);
+        } break;
+        case 0x09: { // c.jal, c.addiw on RV64
+            if (xlen == 64) {
+                if (rd == 0) return false;
+                *instr = enc_i(0x1B, 0x0, rd, rd, imm6);
+            } else {
+                *instr = enc_j(1, j_off);
+            }
+        } break;
+        case 0x0A: { // c.li
+            *instr = enc_i(0x13, 0x0, rd, 0, imm6);
+        } break;
+        case 0x0B: { // c.addi16sp, c.lui
+            if (rd == 2) {
+                int32_t nzimm = csext(cbit(c, 12, 9) | cbit(c, 6, 4) | cbit(c, 5, 6) | (((c >> 3) & 0x3) << 7) | cbit(c, 2, 5), 10);
+                if (nzimm == 0) return false;
+                *instr = enc_i(0x13, 0x0, 2, 2, nzimm);
+            } else {
+                if (imm6 == 0) return false;
+                *instr = ((uint32_t)imm6 << 12) | (rd << 7) | 0x37;
+            }
+        } break;
+        case 0x0C: {
+            switch ((c >> 10) & 0x3) {
+                case 0x0: { // c.srli
+                    if (xlen == 32 && shamt >= 32) return false;
+                    *instr = enc_i(0x13, 0x5, rs1_p, rs1_p, shamt);
+                } break;
+                case 0x1: { // c.srai
+                    if (xlen == 32 && shamt >= 32) return false;
+                    *instr = enc_i(0x13, 0x5, rs1_p, rs1_p, 0x400 | shamt);
+                } break;
+                case 0x2: { // c.andi
+                    *instr = enc_i(0x13, 0x7, rs1_p, rs1_p, imm6);
+                } break;
+                case 0x3: {
+                    uint32_t op = (c >> 5) & 0x3;
+                    if (c & 0x1000) { // c.subw, c.addw
+                        if (xlen == 32 || op >= 2) return false;
+                        *instr = enc_r(0x3B, 0x0, op == 0 ? 0x20 : 0x00, rs1_p, rs1_p, rd_p);
+                    } else { // c.sub, c.xor, c.or, c.and
+                        static const uint32_t funct3s[4] = {0x0, 0x4, 0x6, 0x7};
+                        *instr = enc_r(0x33, funct3s[op], op == 0 ? 0x20 : 0x00, rs1_p, rs1_p, rd_p);
+                    }
+                } break;
+            }
+        } break;
+        case 0x0D: { // c.j
+            *instr = enc_j(0, j_off);
+        } break;
+        case 0x0E: { // c.beqz
+            *instr = enc_b(0x0, rs1_p, 0, b_off);
+        } break;
+        case 0x0F: { // c.bnez
+            *instr = enc_b(0x1, rs1_p, 0, b_off);
+        } break;
+
+        // Quadrant 2
+        case 0x10: { // c.slli
+            if (xlen == 32 && shamt >= 32) return false;
+            *instr = enc_i(0x13, 0x1, rd, rd, shamt);
+        } break;
+        case 0x12: { // c.lwsp
+            if (rd == 0) return false;
+            *instr = enc_i(0x03, 0x2, rd, 2, wsp_load);
+        } break;
+        case 0x13: { // c.flwsp, c.ldsp on RV64
+            if (xlen == 64) {
+                if (rd == 0) return false;
+                *instr = enc_i(0x03, 0x3, rd, 2, dsp_load);
+            } else {
+                *instr = enc_i(0x07, 0x2, rd, 2, wsp_load);
+            }
+        } break;
+        case 0x14: {
+            if (!(c & 0x1000)) {
+                if (rs2 != 0) *instr = enc_r(0x33, 0x0, 0x00, rd, 0, rs2); // c.mv
+                else if (rd != 0) *instr = enc_i(0x67, 0x0, 0, rd, 0);     // c.jr
+                else return false;
+            } else {
+                if (rs2 != 0) *instr = enc_r(0x33, 0x0, 0x00, rd, rd, rs2); // c.add
+                else if (rd != 0) *instr = enc_i(0x67, 0x0, 1, rd, 0);      // c.jalr
+                else *instr = 0x00100073;                                   // c.ebreak
+            }
+        } break;
+        case 0x16: { // c.swsp
+            *instr = enc_s(0x23, 0x2, 2, rs2, wsp_store);
+        } break;
+        case 0x17: { // c.fswsp, c.sdsp on RV64
+            if (xlen == 64) *instr = enc_s(0x23, 0x3, 2, rs2, dsp_store);
+            else *instr = enc_s(0x27, 0x2, 2, rs2, wsp_store);
+        } break;
+
+        // The double-precision loads and stores, without D
+        default: return false;
     }
-    *data = (mem[addr + 3] << 24) | (mem[addr + 2] << 16) | (mem[addr + 1] << 8) | mem[addr];    
+    return true;
 }
 
-void RISCV32::Memory32::write_mem_u8(uint32_t addr, uint8_t data) {
-    if (mem_access_align == 1 && addr % 1 != 0) {
-        MEM_ALIGN_ERR;
-    }
-    if (addr >= MEM_SIZE) {
-        MEM_OUT_ERR;
+template <class Cfg>
+RISCV32::Handler32 RISCV32::handler_of(uint8_t op) {
+    switch (op) {
+        case OP_HALT: return nullptr;
+        case OP_ILLEGAL: return illegal;
+        case OP_UNKNOWN: return unknown;
+        case OP_LUI: return base_I32::lui<Cfg>;
+        case OP_AUIPC: return base_I32::auipc<Cfg>;
+        case OP_JAL: return base_I32::jal<Cfg>;
+        case OP_JALR: return base_I32::jalr<Cfg>;
+        case OP_BEQ: return base_I32::beq<Cfg>;
+        case OP_BNE: return base_I32::bne<Cfg>;
+        case OP_BLT: return base_I32::blt<Cfg>;
+        case OP_BGE: return base_I32::bge<Cfg>;
+        case OP_BLTU: return base_I32::bltu<Cfg>;
+        case OP_BGEU: return base_I32::bgeu<Cfg>;
+        case OP_LB: return base_I32::lb<Cfg>;
+        case OP_LH: return base_I32::lh<Cfg>;
+        case OP_LW: return base_I32::lw<Cfg>;
+        case OP_LBU: return base_I32::lbu<Cfg>;
+        case OP_LHU: return base_I32::lhu<Cfg>;
+        case OP_SB: return base_I32::sb<Cfg>;
+        case OP_SH: return base_I32::sh<Cfg>;
+        case OP_SW: return base_I32::sw<Cfg>;
+        case OP_ADDI: return base_I32::addi<Cfg>;
+        case OP_SLTI: return base_I32::slti<Cfg>;
+        case OP_SLTIU: return base_I32::sltiu<Cfg>;
+        case OP_XORI: return base_I32::xori<Cfg>;
+        case OP_ORI: return base_I32::ori<Cfg>;
+        case OP_ANDI: return base_I32::andi<Cfg>;
+        case OP_SLLI: return base_I32::slli<Cfg>;
+        case OP_SRLI: return base_I32::srli<Cfg>;
+        case OP_SRAI: return base_I32::srai<Cfg>;
+        case OP_ADD: return base_I32::add<Cfg>;
+        case OP_SUB: return base_I32::sub<Cfg>;
+        case OP_SLL: return base_I32::sll<Cfg>;
+        case OP_SLT: return base_I32::slt<Cfg>;
+        case OP_SLTU: return base_I32::sltu<Cfg>;
+        case OP_XOR: return base_I32::xor_<Cfg>;
+        case OP_SRL: return base_I32::srl<Cfg>;
+        case OP_SRA: return base_I32::sra<Cfg>;
+        case OP_OR: return base_I32::or_<Cfg>;
+        case OP_AND: return base_I32::and_<Cfg>;
+        case OP_CSRRW: return Zicsr32::csrrw<Cfg>;
+        case OP_CSRRS: return Zicsr32::csrrs<Cfg>;
+        case OP_CSRRC: return Zicsr32::csrrc<Cfg>;
+        case OP_CSRRWI: return Zicsr32::csrrwi<Cfg>;
+        case OP_CSRRSI: return Zicsr32::csrrsi<Cfg>;
+        case OP_CSRRCI: return Zicsr32::csrrci<Cfg>;
+        case OP_MUL: return ext_M32::mul<Cfg>;
+        case OP_MULH: return ext_M32::mulh<Cfg>;
+        case OP_MULHSU: return ext_M32::mulhsu<Cfg>;
+        case OP_MULHU: return ext_M32::mulhu<Cfg>;
+        case OP_DIV: return ext_M32::div<Cfg>;
+        case OP_DIVU: return ext_M32::divu<Cfg>;
+        case OP_REM: return ext_M32::rem<Cfg>;
+        case OP_REMU: return ext_M32::remu<Cfg>;
+        case OP_FENCE: return base_I32::fence<Cfg>;
+        case OP_FENCE_I: return base_I32::fence_i<Cfg>;
+        case OP_LR_W: return ext_A32::lr_w<Cfg>;
+        case OP_SC_W: return ext_A32::sc_w<Cfg>;
+        case OP_AMOSWAP_W: case OP_AMOADD_W: case OP_AMOXOR_W: case OP_AMOAND_W: case OP_AMOOR_W:
+        case OP_AMOMIN_W: case OP_AMOMAX_W: case OP_AMOMINU_W: case OP_AMOMAXU_W: return ext_A32::amo_w<Cfg>;
+        case OP_FLW: return ext_F32::flw<Cfg>;
+        case OP_FSW: return ext_F32::fsw<Cfg>;
+        case OP_FMADD_S: case OP_FMSUB_S: case OP_FNMSUB_S: case OP_FNMADD_S: return ext_F32::fmadd_s<Cfg>;
+        case OP_FADD_S: return ext_F32::fadd_s<Cfg>;
+        case OP_FSUB_S: return ext_F32::fsub_s<Cfg>;
+        case OP_FMUL_S: return ext_F32::fmul_s<Cfg>;
+        case OP_FDIV_S: return ext_F32::fdiv_s<Cfg>;
+        case OP_FSQRT_S: return ext_F32::fsqrt_s<Cfg>;
+        case OP_FSGNJ_S: case OP_FSGNJN_S: case OP_FSGNJX_S: return ext_F32::fsgnj_s<Cfg>;
+        case OP_FMIN_S: case OP_FMAX_S: return ext_F32::fmin_s<Cfg>;
+        case OP_FCVT_W_S: return ext_F32::fcvt_w_s<Cfg>;
+        case OP_FCVT_WU_S: return ext_F32::fcvt_wu_s<Cfg>;
+        case OP_FMV_X_W: return ext_F32::fmv_x_w<Cfg>;
+        case OP_FEQ_S: case OP_FLT_S: case OP_FLE_S: return ext_F32::fcmp_s<Cfg>;
+        case OP_FCLASS_S: return ext_F32::fclass_s<Cfg>;
+        case OP_FCVT_S_W: return ext_F32::fcvt_s_w<Cfg>;
+        case OP_FCVT_S_WU: return ext_F32::fcvt_s_wu<Cfg>;
+        case OP_FMV_W_X: return ext_F32::fmv_w_x<Cfg>;
+        case OP_LWU: return base_I64::lwu<Cfg>;
+        case OP_LD: return base_I64::ld<Cfg>;
+        case OP_SD: return base_I64::sd<Cfg>;
+        case OP_ADDIW: return base_I64::addiw<Cfg>;
+        case OP_SLLIW: return base_I64::slliw<Cfg>;
+        case OP_SRLIW: return base_I64::srliw<Cfg>;
+        case OP_SRAIW: return base_I64::sraiw<Cfg>;
+        case OP_ADDW: return base_I64::addw<Cfg>;
+        case OP_SUBW: return base_I64::subw<Cfg>;
+        case OP_SLLW: return base_I64::sllw<Cfg>;
+        case OP_SRLW: return base_I64::srlw<Cfg>;
+        case OP_SRAW: return base_I64::sraw<Cfg>;
+        case OP_MULW: return ext_M64::mulw<Cfg>;
+        case OP_DIVW: return ext_M64::divw<Cfg>;
+        case OP_DIVUW: return ext_M64::divuw<Cfg>;
+        case OP_REMW: return ext_M64::remw<Cfg>;
+        case OP_REMUW: return ext_M64::remuw<Cfg>;
+        case OP_SLT_BEQ: case OP_SLT_BNE: case OP_SLTU_BEQ: case OP_SLTU_BNE: return base_I32::slt_branch<Cfg>;
+        case OP_ECALL: return Syscall32::ecall<Cfg>;
+        case OP_MRET: return Machine32::mret<Cfg>;
+        case OP_WFI: return Machine32::wfi<Cfg>;
+        default: return unknown;
     }
-    mem[addr] = data;
 }
 
-void RISCV32::Memory32::write_mem_u16(uint32_t addr, uint16_t data) {
-    if (mem_access_align == 1 && addr % 2 != 0) {
-        MEM_ALIGN_ERR;
-    }
-    if (addr >= MEM_SIZE - 1) {
-        MEM_OUT_ERR;
+template <class Cfg>
+void RISCV32::execute32(uint32_t instr) {
+    Decoded32 inst;
+    decode32(instr, &inst);
+    inst.pc = pc;
+    inst.len = 4;
+    inst.count = 1;
+    inst.handler = handler_of<Cfg>(inst.op);
+    if (inst.handler != nullptr) {
+        inst.handler(*this, inst);
     }
-    mem[addr] = data & 0xFF;
-    mem[addr + 1] = (data >> 8) & 0xFF;
 }
 
-void RISCV32::Memory32::write_mem_u32(uint32_t addr, uint32_t data) {
-    if (mem_access_align == 1 && addr % 4 != 0) {
-        MEM_ALIGN_ERR;
+// RVC instructions are expanded here, so blocks only ever hold 32-bit forms
+template <class Cfg>
+bool RISCV32::fetch_instr(uint32_t addr, uint32_t* instr, uint16_t* parcel) {
+    *parcel = 0;
+    if (!ext.C) {
+        memory.read_mem_u32<Cfg::align>(addr, instr);
+        return true;
     }
-    if (addr >= MEM_SIZE - 3) {
-        MEM_OUT_ERR;
+    uint16_t low;
+    memory.read_mem_u16<Cfg::align>(addr, &low);
+    if ((low & 0x3) == 0x3) {
+        memory.read_mem_u32<false>(addr, instr); // may straddle a word or page boundary
+        return true;
     }
-    mem[addr] = data & 0xFF;
-    mem[addr + 1] = (data >> 8) & 0xFF;
-    mem[addr + 2] = (data >> 16) & 0xFF;
-    mem[addr + 3] = (data >> 24) & 0xFF;
-}
-
-void RISCV32::Memory32::read_program(const char* program_file) { 
-    std::ifstream program(program_file, std::ios::in | std::ios::binary);
-    if (!program.is_open()) {
-        throw std::runtime_error("Failed to open program file.");
+    *parcel = low;
+    if (low == 0) { // terminates the program like the zero word
+        *instr = 0;
+        return true;
     }
-    program.read((char*)Memory32::mem, MEM_SIZE);
-    program.close();
+    return expand16(low, Cfg::xlen, instr);
 }
 
-void RISCV32::Memory32::print_mem_all() {
-    std::cout << "Memory" << std::endl;
-    std::cout << "  Address |   Data" << std::endl;
-    std::cout << "--------------------" << std::endl;
-    for (int i = 0; i < MEM_SIZE / 4; i++) {
-        std::cout << " ";
-        std::cout.width(8);
-        std::cout << std::hex << i << " | ";
-        int data = (mem[i * 4 + 3] << 24) | (mem[i * 4 + 2] << 16) | (mem[i * 4 + 1] << 8) | mem[i * 4];
-        std::cout.width(8);
-        std::cout.fill('0');
-        std::cout << std::hex << data << std::endl;
+template <class Cfg>
+const RISCV32::Decoded32& RISCV32::fetch_decoded(uint32_t addr) {
+    Decoded32& inst = decode_cache[(addr >> 1) & (DECODE_CACHE_SIZE - 1)];
+    if (inst.pc != addr) {
+        counters.decode_misses++;
+        uint32_t instr;
+        uint16_t parcel;
+        bool legal = fetch_instr<Cfg>(addr, &instr, &parcel);
+        decode32(instr, &inst);
+        inst.len = (parcel != 0) ? 2 : 4;
+        inst.count = 1;
+        if (!legal) inst.op = OP_ILLEGAL;
+        if (Cfg::xlen == 32 && inst.op >= OP_LWU && inst.op <= OP_REMUW) inst.op = OP_ILLEGAL;
+        if (Cfg::xlen == 32 && (inst.op == OP_SLLI || inst.op == OP_SRLI || inst.op == OP_SRAI) && (inst.imm & 0x20)) inst.op = OP_ILLEGAL;
+        if (inst.op >= OP_MUL && inst.op <= OP_REMU && !ext.M) inst.op = OP_ILLEGAL;
+        if (inst.op >= OP_MULW && inst.op <= OP_REMUW && !ext.M) inst.op = OP_ILLEGAL;
+        if (inst.op >= OP_LR_W && inst.op <= OP_AMOMAXU_W && !ext.A) inst.op = OP_ILLEGAL;
+        if (inst.op >= OP_FLW && inst.op <= OP_FMV_W_X && !ext.F) inst.op = OP_ILLEGAL;
+        inst.handler = handler_of<Cfg>(inst.op);
+        inst.pc = addr;
     }
+    return inst;
 }
 
-void RISCV32::Memory32::print_mem_u8(uint32_t addr) {
-    uint8_t data;
-    read_mem_u8(addr, &data);
-    std::cout << "Memory[" << addr << "]: " << std::hex << (int)data << std::endl;
+bool RISCV32::ends_block(const Decoded32& inst) {
+    switch (inst.op) {
+        case OP_JAL:
+        case OP_JALR:
+        case OP_ECALL: // may end the program
+        case OP_MRET:
+        case OP_WFI:
+        case OP_FENCE_I: // what follows is fetched again
+        case OP_BEQ:
+        case OP_BNE:
+        case OP_BLT:
+        case OP_BGE:
+        case OP_BLTU:
+        case OP_BGEU: {
+            return true;
+        } break;
+        default: {
+            return is_csr(inst);
+        } break;
+    }
 }
 
-void RISCV32::Memory32::print_mem_u16(uint32_t addr) {
-    uint16_t data;
-    read_mem_u16(addr, &data);
-    std::cout << "Memory[" << addr << "]: " << std::hex << (int)data << std::endl;
+bool RISCV32::is_csr(const Decoded32& inst) {
+    return inst.op >= OP_CSRRW && inst.op <= OP_CSRRCI;
 }
 
-void RISCV32::Memory32::print_mem_u32(uint32_t addr) {
-    uint32_t data;
-    read_mem_u32(addr, &data);
-    std::cout << "Memory[" << addr << "]: " << std::hex << (int)data << std::endl;
+bool RISCV32::writes_freg(uint8_t op) {
+    switch (op) {
+        case OP_FCVT_W_S: case OP_FCVT_WU_S: case OP_FMV_X_W:
+        case OP_FEQ_S: case OP_FLT_S: case OP_FLE_S: case OP_FCLASS_S: return false;
+        default: return op >= OP_FLW && op <= OP_FMV_W_X && op != OP_FSW;
+    }
 }
 
-// U-type
-void RISCV32::base_I32::lui(uint32_t rd, uint32_t imm) {
-    if (debug_mode == 1) {
-        print_inst(pc, "lui " + std::to_string(rd) + ", " + std::to_string(imm));
+// Compiler idioms whose second instruction folds into the record of the first:
+// lui/auipc + addi (addiw) into one constant, auipc + jalr into a jal, auipc + load into a load off x0,
+// and slt/sltu + beqz/bnez into one compare and branch. The second instruction keeps its own decode
+// cache entry, so a block starting at it runs it alone.
+template <class Cfg>
+bool RISCV32::fuse(Decoded32* first, const Decoded32& second) {
+    if (first->count != 1 || first->rd == 0) return false;
+    int64_t hi = (int32_t)first->imm;
+    int64_t lo = (int32_t)second.imm;
+    bool from_rd = second.rs1 == first->rd && second.rd == first->rd;
+    // RV64 adds the halves at 64 bits, the folded immediate only sign-extends from 32
+    bool fits = Cfg::xlen == 32 || hi + lo == (int32_t)(uint32_t)(hi + lo);
+
+    uint8_t op;
+    uint32_t imm;
+    uint8_t rs1 = first->rs1;
+    uint8_t rs2 = first->rs2;
+    switch (first->op) {
+        case OP_LUI: {
+            if (!from_rd) return false;
+            if (second.op == OP_ADDIW || (second.op == OP_ADDI && fits)) op = OP_LUI;
+            else return false;
+            imm = hi + lo;
+        } break;
+        case OP_AUIPC: {
+            if (!from_rd) return false;
+            int64_t addr = (int64_t)first->pc + hi + lo;
+            if (second.op == OP_ADDI && fits) {
+                op = OP_AUIPC;
+                imm = hi + lo;
+            } else if (second.op == OP_JALR) {
+                addr &= ~(int64_t)1;
+                if (Cfg::xlen == 64 && (addr < 0 || addr > UINT32_MAX)) return false;
+                op = OP_JAL;
+                imm = (uint32_t)addr - first->pc;
+            } else if ((second.op >= OP_LB && second.op <= OP_LHU) || second.op == OP_LWU || second.op == OP_LD) {
+                if (Cfg::xlen == 64 && (addr < 0 || addr > INT32_MAX)) return false;
+                op = second.op;
+                imm = addr;
+                rs1 = 0;
+            } else {
+                return false;
+            }
+        } break;
+        case OP_SLT:
+        case OP_SLTU: {
+            bool on_rd = (second.rs1 == first->rd && second.rs2 == 0) || (second.rs1 == 0 && second.rs2 == first->rd);
+            if (!on_rd || (second.op != OP_BEQ && second.op != OP_BNE)) return false;
+            if (first->op == OP_SLT) op = (second.op == OP_BEQ) ? OP_SLT_BEQ : OP_SLT_BNE;
+            else op = (second.op == OP_BEQ) ? OP_SLTU_BEQ : OP_SLTU_BNE;
+            imm = first->len + second.imm; // the branch offset, from the pc of the pair
+        } break;
+        default: return false;
     }
-    if (rd != 0) reg32[rd] = imm;
+    first->op = op;
+    first->imm = imm;
+    first->rs1 = rs1;
+    first->rs2 = rs2;
+    first->len += second.len;
+    first->count = 2;
+    first->handler = handler_of<Cfg>(op);
+    return true;
 }
 
-void RISCV32::base_I32::auipc(uint32_t rd, uint32_t imm) {
-    if (debug_mode == 1) {
-        print_inst(pc, "auipc " + std::to_string(rd) + ", " + std::to_string((int32_t)imm));
+template <class Cfg>
+RISCV32::Block32* RISCV32::translate_block(uint32_t addr) {
+    Block32& block = block_cache[addr];
+    block.insts.clear(); // stale blocks are translated again in place, links to them stay valid
+    block.stale = true;  // until complete; a fetch that faults leaves it to be translated again
+    block.halt = false;
+    block.exec_count = 0;
+    block.jit_code = nullptr;
+    block.succ_pc[0] = block.succ_pc[1] = 0xFFFFFFFF;
+    block.succ[0] = block.succ[1] = nullptr;
+    block.loads = block.stores = 0;
+    block.cond_branch = false;
+    block.link = LINK_NONE;
+    block.retired = block.fused = 0;
+
+    uint32_t cur = addr;
+    while (block.insts.size() < BLOCK_MAX_INSTS) {
+        if (cur == stop_pc && cur != addr) break; // stop points start a block
+        const Decoded32& inst = fetch_decoded<Cfg>(cur);
+        block.fetch_end = cur + inst.len;
+        if (inst.op == OP_HALT) {
+            block.halt = true;
+            break;
+        }
+        // Traced runs keep every instruction in its own record
+        if (Cfg::debug || block.insts.empty() || !fuse<Cfg>(&block.insts.back(), inst)) block.insts.push_back(inst);
+        else block.fused++;
+        block.retired++;
+        if ((inst.op >= OP_LB && inst.op <= OP_LHU) || inst.op == OP_LWU || inst.op == OP_LD || inst.op == OP_FLW) block.loads++;
+        if ((inst.op >= OP_SB && inst.op <= OP_SW) || inst.op == OP_SD || inst.op == OP_FSW) block.stores++;
+        block.cond_branch = inst.op >= OP_BEQ && inst.op <= OP_BGEU;
+        // Calls link through ra or t0, returns jump back through them
+        bool link_reg_rd = inst.rd == 1 || inst.rd == 5;
+        if ((inst.op == OP_JAL || inst.op == OP_JALR) && link_reg_rd) block.link = LINK_CALL;
+        else if (inst.op == OP_JALR && inst.rd == 0 && (inst.rs1 == 1 || inst.rs1 == 5)) block.link = LINK_RETURN;
+        cur += inst.len;
+        if (ends_block(inst) || cur == 0) break; // pc wraps around past the top of memory
     }
-    if (rd != 0) reg32[rd] = pc + (int32_t)imm;
+    block.end_pc = cur;
+    add_code(block, addr);
+    block.stale = false;
+    return &block;
 }
 
-// J-type
-void RISCV32::base_I32::jal(uint32_t rd, uint32_t imm) {
-    if (debug_mode == 1) {
-        print_inst(pc, "jal " + std::to_string(rd) + ", " + std::to_string((int32_t)imm));
-    }
-    if (rd != 0) reg32[rd] = pc + 4;
-    pc_next = pc + (int32_t)imm;
+template <class Cfg>
+RISCV32::Block32* RISCV32::lookup_block(uint32_t addr) {
+    std::unordered_map<uint32_t, Block32>::iterator it = block_cache.find(addr);
+    if (it != block_cache.end() && !it->second.stale) return &it->second;
+    return translate_block<Cfg>(addr);
 }
 
-// I-type
-void RISCV32::base_I32::jalr(uint32_t rd, uint32_t rs1, uint32_t imm) {
-    if (debug_mode == 1) {
-        print_inst(pc, "jalr " + std::to_string(rd) + ", " + std::to_string(rs1) + ", " + std::to_string((int32_t)imm));
+// Every page the block decoded from, which may be one past its last instruction
+void RISCV32::add_code(const Block32& block, uint32_t addr) {
+    uint32_t last = block.fetch_end - 1; // the top page when the code ends at 4 GiB
+    for (uint32_t page = addr >> MEM_PAGE_SHIFT; page <= last >> MEM_PAGE_SHIFT; page++) {
+        std::vector<uint32_t>& blocks = code_pages[page];
+        if (std::find(blocks.begin(), blocks.end(), addr) == blocks.end()) blocks.push_back(addr);
+        memory.mark_code(page);
     }
-    if (rd != 0) reg32[rd] = pc + 4;
-    pc_next = (reg32[rs1] + (int32_t)imm) & 0xFFFFFFFE;
 }
 
-// B-type
-void RISCV32::base_I32::beq(uint32_t rs1, uint32_t rs2, uint32_t imm) {
-    if (debug_mode == 1) {
-        print_inst(pc, "beq " + std::to_string(rs1) + ", " + std::to_string(rs2) + ", " + std::to_string((int32_t)imm));
+// Drops the decode cache entries and blocks holding any of the bytes; the block running now finishes as decoded
+void RISCV32::invalidate_code(uint32_t addr, uint32_t size) {
+    uint64_t end = (uint64_t)addr + size;
+    uint64_t first = (addr >= 3) ? addr - 3 : 0; // instructions are at most 4 bytes
+    if ((end - first) / 2 >= DECODE_CACHE_SIZE) {
+        for (int i = 0; i < DECODE_CACHE_SIZE; i++) {
+            if (decode_cache[i].pc >= first && decode_cache[i].pc < end) decode_cache[i].pc = 0xFFFFFFFF;
+        }
+    } else {
+        for (uint64_t pc = first & ~(uint64_t)1; pc < end; pc += 2) {
+            Decoded32& inst = decode_cache[(pc >> 1) & (DECODE_CACHE_SIZE - 1)];
+            if (inst.pc == pc) inst.pc = 0xFFFFFFFF;
+        }
     }
-    if (reg32[rs1] == reg32[rs2]) {
-        pc_next = pc + (int32_t)imm;
+
+    bool dropped = false;
+    for (uint64_t page = first >> MEM_PAGE_SHIFT; page <= (end - 1) >> MEM_PAGE_SHIFT; page++) {
+        std::unordered_map<uint32_t, std::vector<uint32_t> >::iterator it = code_pages.find(page);
+        if (it == code_pages.end()) continue;
+        std::vector<uint32_t>& blocks = it->second;
+        for (size_t i = 0; i < blocks.size(); ) {
+            Block32& block = block_cache[blocks[i]];
+            // Blocks dropped through another page leave here as well
+            if (!block.stale && (blocks[i] >= end || (block.fetch_end <= addr && block.fetch_end != 0))) {
+                i++;
+                continue;
+            }
+            if (!block.stale) {
+                block.stale = true;
+                block.jit_code = nullptr;
+                dropped = true;
+            }
+            blocks[i] = blocks.back();
+            blocks.pop_back();
+        }
+        if (blocks.empty()) {
+            code_pages.erase(it);
+            memory.clear_code(page);
+        }
     }
+    if (dropped) unlink_stale();
 }
 
-void RISCV32::base_I32::bne(uint32_t rs1, uint32_t rs2, uint32_t imm) {
-    if (debug_mode == 1) {
-        print_inst(pc, "bne " + std::to_string(rs1) + ", " + std::to_string(rs2) + ", " + std::to_string((int32_t)imm));
+// After fence.i when other harts wrote code, and nowhere else
+void RISCV32::flush_code() {
+    for (int i = 0; i < DECODE_CACHE_SIZE; i++) {
+        decode_cache[i].pc = 0xFFFFFFFF;
     }
-    if (reg32[rs1] != reg32[rs2]) {
-        pc_next = pc + (int32_t)imm;
+    for (std::unordered_map<uint32_t, Block32>::iterator it = block_cache.begin(); it != block_cache.end(); it++) {
+        it->second.stale = true;
     }
+    unlink_stale();
+    for (std::unordered_map<uint32_t, std::vector<uint32_t> >::iterator it = code_pages.begin(); it != code_pages.end(); it++) {
+        memory.clear_code(it->first);
+    }
+    code_pages.clear();
+    jit.flush(*this);
 }
 
-void RISCV32::base_I32::blt(uint32_t rs1, uint32_t rs2, uint32_t imm) {
-    if (debug_mode == 1) {
-        print_inst(pc, "blt " + std::to_string(rs1) + ", " + std::to_string(rs2) + ", " + std::to_string((int32_t)imm));
-    }
-    if ((int32_t)reg32[rs1] < (int32_t)reg32[rs2]) {
-        pc_next = pc + (int32_t)imm;
+// Chained blocks go through lookup_block again to reach a stale one
+void RISCV32::unlink_stale() {
+    for (std::unordered_map<uint32_t, Block32>::iterator it = block_cache.begin(); it != block_cache.end(); it++) {
+        Block32& block = it->second;
+        for (int slot = 0; slot < 2; slot++) {
+            if (block.succ[slot] != nullptr && block.succ[slot]->stale) {
+                block.succ_pc[slot] = 0xFFFFFFFF;
+                block.succ[slot] = nullptr;
+            }
+        }
     }
 }
 
-void RISCV32::base_I32::bge(uint32_t rs1, uint32_t rs2, uint32_t imm) {
-    if (debug_mode == 1) {
-        print_inst(pc, "bge " + std::to_string(rs1) + ", " + std::to_string(rs2) + ", " + std::to_string((int32_t)imm));
-    }
-    if ((int32_t)reg32[rs1] >= (int32_t)reg32[rs2]) {
-        pc_next = pc + (int32_t)imm;
-    }
+template <class Cfg>
+RISCV32::Block32* RISCV32::chain_block(Block32* block) {
+    // Follow an existing link without leaving the dispatch loop
+    if (block->succ_pc[0] == pc) return block->succ[0];
+    if (block->succ_pc[1] == pc) return block->succ[1];
+
+    Block32* next = lookup_block<Cfg>(pc);
+
+    // Link into a free slot; blocks are never freed, so links stay valid
+    int slot = (block->succ_pc[0] == 0xFFFFFFFF) ? 0 : 1;
+    block->succ_pc[slot] = pc;
+    block->succ[slot] = next;
+    return next;
 }
 
-void RISCV32::base_I32::bltu(uint32_t rs1, uint32_t rs2, uint32_t imm) {
-    if (debug_mode == 1) {
-        print_inst(pc, "bltu " + std::to_string(rs1) + ", " + std::to_string(rs2) + ", " + std::to_string((int32_t)imm));
-    }
-    if (reg32[rs1] < reg32[rs2]) {
-        pc_next = pc + (int32_t)imm;
-    }
+void RISCV32::illegal(RISCV32&, const Decoded32&) {
+    INSTR_ERR;
 }
 
-void RISCV32::base_I32::bgeu(uint32_t rs1, uint32_t rs2, uint32_t imm) {
-    if (debug_mode == 1) {
-        print_inst(pc, "bgeu " + std::to_string(rs1) + ", " + std::to_string(rs2) + ", " + std::to_string((int32_t)imm));
+void RISCV32::unknown(RISCV32&, const Decoded32&) {
+    // Opcodes without an implemented extension are skipped.
+}
+
+// Outside a run there is nothing to trap into, so faults throw as they always did
+void RISCV32::fault(uint8_t kind, uint64_t tval) {
+    if (fault_jmp == nullptr) throw std::runtime_error(fault_message(kind));
+    fault_kind = kind;
+    fault_tval = tval;
+    fault_host_pc = 0;
+    siglongjmp(*fault_jmp, 1);
+}
+
+static void guest_fault_handler(int sig, siginfo_t* info, void* context) {
+    uint8_t* addr = (uint8_t*)info->si_addr;
+    if (fault_jmp != nullptr && addr >= fault_mem && addr < fault_mem + MEM_SIZE + MEM_GUARD_SIZE) {
+        fault_kind = RISCV32::FAULT_ACCESS;
+        fault_tval = (uint32_t)(addr - fault_mem);
+        fault_host_pc = 0;
+#if defined(__x86_64__) && defined(__linux__)
+        // Translated code keeps guest registers in host registers, in x86 numbering
+        static const int gregs[16] = {
+            REG_RAX, REG_RCX, REG_RDX, REG_RBX, REG_RSP, REG_RBP, REG_RSI, REG_RDI,
+            REG_R8, REG_R9, REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15
+        };
+        const mcontext_t& mc = ((ucontext_t*)context)->uc_mcontext;
+        for (int i = 0; i < 16; i++) fault_host_regs[i] = mc.gregs[gregs[i]];
+        fault_host_pc = mc.gregs[REG_RIP];
+#endif
+        siglongjmp(*fault_jmp, 1);
+    }
+    // Not a guest access, the default action runs when the access repeats
+    signal(sig, SIG_DFL);
+}
+
+void RISCV32::Memory32::install_fault_handler() {
+    static bool installed = [] {
+        struct sigaction sa;
+        sa.sa_sigaction = guest_fault_handler;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigaction(SIGSEGV, &sa, nullptr);
+        return true;
+    }();
+    (void)installed;
+}
+
+RISCV32::Memory32::FaultScope::FaultScope(Memory32& memory, sigjmp_buf* jmp) {
+    fault_mem = memory.mem;
+    fault_jmp = jmp;
+}
+
+RISCV32::Memory32::FaultScope::~FaultScope() {
+    fault_jmp = nullptr;
+    fault_mem = nullptr;
+}
+
+RISCV32::Memory32::Memory32() {
+    // Reserve the page maps, the whole guest space and a guard region; pages are zero-filled on first touch
+    size_t total = MEM_CODE_BYTES + MEM_DIRTY_GROUP_BYTES + MEM_DIRTY_BYTES + MEM_SIZE + MEM_GUARD_SIZE;
+    uint8_t* base = (uint8_t*)mmap(nullptr, total, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        throw std::runtime_error("Failed to reserve guest memory.");
     }
-    if (reg32[rs1] >= reg32[rs2]) {
-        pc_next = pc + (int32_t)imm;
+    if (mprotect(base, total - MEM_GUARD_SIZE, PROT_READ | PROT_WRITE) != 0) {
+        munmap(base, total);
+        throw std::runtime_error("Failed to reserve guest memory.");
     }
+    // The maps sit right below guest memory, so translated code reaches them from the memory base
+    code = base;
+    dirty_groups = code + MEM_CODE_BYTES;
+    dirty = dirty_groups + MEM_DIRTY_GROUP_BYTES;
+    mem = dirty + MEM_DIRTY_BYTES;
+    owner = true;
+    hart = nullptr;
+    code_bit = 0;
+    foreign_code_stores = std::make_shared<std::atomic<uint64_t> >(0);
+    install_fault_handler();
 }
 
-// I-type
-void RISCV32::base_I32::lb(uint32_t rd, uint32_t rs1, uint32_t imm) {
-    if (debug_mode == 1) {
-        print_inst(pc, "lb " + std::to_string(rd) + ", " + std::to_string((int32_t)imm) + "(" + std::to_string(rs1) + ")");
+RISCV32::Memory32::Memory32(Memory32* shared) {
+    mem = shared->mem;
+    dirty = shared->dirty;
+    dirty_groups = shared->dirty_groups;
+    code = shared->code;
+    owner = false;
+    hart = nullptr;
+    code_bit = 0;
+    foreign_code_stores = shared->foreign_code_stores;
+}
+
+RISCV32::Memory32::~Memory32() {
+    if (owner) munmap(code, MEM_CODE_BYTES + MEM_DIRTY_GROUP_BYTES + MEM_DIRTY_BYTES + MEM_SIZE + MEM_GUARD_SIZE);
+}
+
+void RISCV32::Memory32::attach_code(RISCV32* hart, uint32_t hartid) {
+    this->hart = hart;
+    code_bit = 1 << (hartid < 7 ? hartid : 7);
+}
+
+// Harts mark and clear their own bits concurrently
+void RISCV32::Memory32::mark_code(uint32_t page) {
+    if ((code[page] & code_bit) == 0) __atomic_fetch_or(&code[page], code_bit, __ATOMIC_RELAXED);
+}
+
+void RISCV32::Memory32::clear_code(uint32_t page) {
+    if (code_bit != 0x80) __atomic_fetch_and(&code[page], (uint8_t)~code_bit, __ATOMIC_RELAXED);
+}
+
+uint64_t RISCV32::Memory32::code_stores_elsewhere() const {
+    return foreign_code_stores->load();
+}
+
+// The own hart drops what it decoded from the bytes at once; other harts wait for their fence.i
+void RISCV32::Memory32::code_written(uint32_t addr, size_t size) {
+    uint8_t bits = code[addr >> MEM_PAGE_SHIFT];
+    if (bits & ~code_bit) foreign_code_stores->fetch_add(1);
+    if (bits & code_bit) hart->invalidate_code(addr, size);
+}
+
+// Stores are at most 8 bytes from addr
+inline void RISCV32::Memory32::mark_dirty(uint32_t addr) {
+    dirty[addr >> MEM_PAGE_SHIFT] = 1;
+    dirty_groups[addr >> (MEM_PAGE_SHIFT + MEM_DIRTY_GROUP_SHIFT)] = 1;
+    if (code[addr >> MEM_PAGE_SHIFT]) code_written(addr, 8);
+}
+
+void RISCV32::Memory32::mark_dirty_range(uint32_t addr, size_t size) {
+    if (size == 0) return;
+    uint64_t last = ((uint64_t)addr + size - 1) >> MEM_PAGE_SHIFT;
+    if (last >= (MEM_SIZE >> MEM_PAGE_SHIFT)) last = (MEM_SIZE >> MEM_PAGE_SHIFT) - 1;
+    for (uint64_t page = addr >> MEM_PAGE_SHIFT; page <= last; page++) {
+        dirty[page] = 1;
+        dirty_groups[page >> MEM_DIRTY_GROUP_SHIFT] = 1;
+        if (code[page]) {
+            uint64_t start = std::max<uint64_t>(addr, page << MEM_PAGE_SHIFT);
+            uint64_t end = std::min<uint64_t>((uint64_t)addr + size, (page + 1) << MEM_PAGE_SHIFT);
+            code_written(start, end - start);
+        }
     }
-    uint8_t data;
-    Memory32::read_mem_u8(reg32[rs1] + (int32_t)imm, &data);
-    if (rd != 0) reg32[rd] = (int32_t)data;
 }
 
-void RISCV32::base_I32::lh(uint32_t rd, uint32_t rs1, uint32_t imm) {
-    if (debug_mode == 1) {
-        print_inst(pc, "lh " + std::to_string(rd) + ", " + std::to_string((int32_t)imm) + "(" + std::to_string(rs1) + ")"); 
+// Guest memory is little-endian; on a little-endian host each value is a single host access
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HOST_LITTLE_ENDIAN 1
+#else
+#define HOST_LITTLE_ENDIAN 0
+#endif
+
+static inline uint16_t load_le16(const uint8_t* p) {
+    if (HOST_LITTLE_ENDIAN) {
+        uint16_t data;
+        std::memcpy(&data, p, 2);
+        return data;
     }
-    uint16_t data;
-    Memory32::read_mem_u16(reg32[rs1] + (int32_t)imm, &data);
-    if (rd != 0) reg32[rd] = (int32_t)data;
+    return (p[1] << 8) | p[0];
 }
 
-void RISCV32::base_I32::lw(uint32_t rd, uint32_t rs1, uint32_t imm) {
-    if (debug_mode == 1) {
-        print_inst(pc, "lw " + std::to_string(rd) + ", " + std::to_string((int32_t)imm) + "(" + std::to_string(rs1) + ")");  
+static inline uint32_t load_le32(const uint8_t* p) {
+    if (HOST_LITTLE_ENDIAN) {
+        uint32_t data;
+        std::memcpy(&data, p, 4);
+        return data;
     }
-    uint32_t data;
-    Memory32::read_mem_u32(reg32[rs1] + (int32_t)imm, &data);
-    if (rd != 0) reg32[rd] = (int32_t)data;
+    return ((uint32_t)p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
 }
 
-void RISCV32::base_I32::lbu(uint32_t rd, uint32_t rs1, uint32_t imm) {
-    if (debug_mode == 1) {
-        print_inst(pc, "lbu " + std::to_string(rd) + ", " + std::to_string((int32_t)imm) + "(" + std::to_string(rs1) + ")"); 
+static inline uint64_t load_le64(const uint8_t* p) {
+    if (HOST_LITTLE_ENDIAN) {
+        uint64_t data;
+        std::memcpy(&data, p, 8);
+        return data;
     }
-    uint8_t data;
-    Memory32::read_mem_u8(reg32[rs1] + (int32_t)imm, &data);
-    if (rd != 0) reg32[rd] = (uint32_t)data;
+    return ((uint64_t)load_le32(p + 4) << 32) | load_le32(p);
 }
 
-void RISCV32::base_I32::lhu(uint32_t rd, uint32_t rs1, uint32_t imm) {
-    if (debug_mode == 1) {
-        print_inst(pc, "lhu " + std::to_string(rd) + ", " + std::to_string((int32_t)imm) + "(" + std::to_string(rs1) + ")");
+static inline void store_le16(uint8_t* p, uint16_t data) {
+    if (HOST_LITTLE_ENDIAN) {
+        std::memcpy(p, &data, 2);
+        return;
     }
-    uint16_t data;
-    Memory32::read_mem_u16(reg32[rs1] + (int32_t)imm, &data);
-    if (rd != 0) reg32[rd] = (uint32_t)data;
+    p[0] = data & 0xFF;
+    p[1] = (data >> 8) & 0xFF;
 }
 
-// S-type
-void RISCV32::base_I32::sb(uint32_t rs1, uint32_t rs2, uint32_t imm) {
-    if (debug_mode == 1) {
-        print_inst(pc, "sb " + std::to_string(rs2) + ", " + std::to_string((int32_t)imm) + "(" + std::to_string(rs1) + ")");
+static inline void store_le32(uint8_t* p, uint32_t data) {
+    if (HOST_LITTLE_ENDIAN) {
+        std::memcpy(p, &data, 4);
+        return;
     }
-    Memory32::write_mem_u8(reg32[rs1] + (int32_t)imm, reg32[rs2] & 0xFF);
+    p[0] = data & 0xFF;
+    p[1] = (data >> 8) & 0xFF;
+    p[2] = (data >> 16) & 0xFF;
+    p[3] = (data >> 24) & 0xFF;
 }
 
-void RISCV32::base_I32::sh(uint32_t rs1, uint32_t rs2, uint32_t imm) {
-    if (debug_mode == 1) {
-        print_inst(pc, "sh " + std::to_string(rs2) + ", " + std::to_string((int32_t)imm) + "(" + std::to_string(rs1) + ")");
+static inline void store_le64(uint8_t* p, uint64_t data) {
+    if (HOST_LITTLE_ENDIAN) {
+        std::memcpy(p, &data, 8);
+        return;
     }
-    Memory32::write_mem_u16(reg32[rs1] + (int32_t)imm, reg32[rs2] & 0xFFFF);
+    store_le32(p, (uint32_t)data);
+    store_le32(p + 4, (uint32_t)(data >> 32));
 }
 
-void RISCV32::base_I32::sw(uint32_t rs1, uint32_t rs2, uint32_t imm) {
-    if (debug_mode == 1) {
-        print_inst(pc, "sw " + std::to_string(rs2) + ", " + std::to_string((int32_t)imm) + "(" + std::to_string(rs1) + ")");
+template <bool Align>
+void RISCV32::Memory32::read_mem_u8(uint32_t addr, uint8_t* data) {
+    if (Align && addr % 1 != 0) {
+        MEM_ALIGN_ERR(addr);
     }
-    Memory32::write_mem_u32(reg32[rs1] + (int32_t)imm, reg32[rs2]);
+    *data = mem[addr];
 }
 
-// I-type
-void RISCV32::base_I32::addi(uint32_t rd, uint32_t rs1, uint32_t imm) {
-    if (debug_mode == 1) {
-        print_inst(pc, "addi " + std::to_string(rd) + ", " + std::to_string(rs1) + ", " + std::to_string(imm));
+template <bool Align>
+void RISCV32::Memory32::read_mem_u16(uint32_t addr, uint16_t* data) {
+    if (Align && addr % 2 != 0) {
+        MEM_ALIGN_ERR(addr);
+    }
+    *data = load_le16(mem + addr);
+}
+
+template <bool Align>
+void RISCV32::Memory32::read_mem_u32(uint32_t addr, uint32_t* data) {
+    if (Align && addr % 4 != 0) {
+        MEM_ALIGN_ERR(addr);
+    }
+    *data = load_le32(mem + addr);
+}
+
+template <bool Align>
+void RISCV32::Memory32::read_mem_u64(uint32_t addr, uint64_t* data) {
+    if (Align && addr % 8 != 0) {
+        MEM_ALIGN_ERR(addr);
+    }
+    *data = load_le64(mem + addr);
+}
+
+template <bool Align>
+void RISCV32::Memory32::write_mem_u8(uint32_t addr, uint8_t data) {
+    if (Align && addr % 1 != 0) {
+        MEM_ALIGN_ERR(addr);
+    }
+    mem[addr] = data;
+    mark_dirty(addr);
+}
+
+template <bool Align>
+void RISCV32::Memory32::write_mem_u16(uint32_t addr, uint16_t data) {
+    if (Align && addr % 2 != 0) {
+        MEM_ALIGN_ERR(addr);
     }
-    if (rd != 0) reg32[rd] = reg32[rs1] + imm;
+    store_le16(mem + addr, data);
+    mark_dirty(addr);
+    if (!Align) mark_dirty(addr + 1); // may straddle a page
 }
 
-void RISCV32::base_I32::slti(uint32_t rd, uint32_t rs1, uint32_t imm) {
-    if (debug_mode == 1) {
-        print_inst(pc, "slti " + std::to_string(rd) + ", " + std::to_string(rs1) + ", " + std::to_string(imm));
+template <bool Align>
+void RISCV32::Memory32::write_mem_u32(uint32_t addr, uint32_t data) {
+    if (Align && addr % 4 != 0) {
+        MEM_ALIGN_ERR(addr);
     }
-    if (rd != 0) reg32[rd] = (int32_t)reg32[rs1] < (int32_t)imm ? 1 : 0;
+    store_le32(mem + addr, data);
+    mark_dirty(addr);
+    if (!Align) mark_dirty(addr + 3); // may straddle a page
 }
 
-void RISCV32::base_I32::sltiu(uint32_t rd, uint32_t rs1, uint32_t imm) {
-    if (debug_mode == 1) {
-        print_inst(pc, "sltiu " + std::to_string(rd) + ", " + std::to_string(rs1) + ", " + std::to_string(imm));
+template <bool Align>
+void RISCV32::Memory32::write_mem_u64(uint32_t addr, uint64_t data) {
+    if (Align && addr % 8 != 0) {
+        MEM_ALIGN_ERR(addr);
     }
-    if (rd != 0) reg32[rd] = reg32[rs1] < imm ? 1 : 0;
+    store_le64(mem + addr, data);
+    mark_dirty(addr);
+    if (!Align) mark_dirty(addr + 7); // may straddle a page
+}
+
+// Bulk transfers, a range running past the top faults into the guard region
+void RISCV32::Memory32::read_block(uint32_t addr, void* data, size_t size) {
+    std::memcpy(data, mem + addr, size);
 }
 
-void RISCV32::base_I32::xori(uint32_t rd, uint32_t rs1, uint32_t imm) {
-    if (debug_mode == 1) {
-        print_inst(pc, "xori " + std::to_string(rd) + ", " + std::to_string(rs1) + ", " + std::to_string(imm));
+void RISCV32::Memory32::write_block(uint32_t addr, const void* data, size_t size) {
+    std::memcpy(mem + addr, data, size);
+    mark_dirty_range(addr, size);
+}
+
+void RISCV32::Memory32::fill(uint32_t addr, uint8_t value, size_t size) {
+    std::memset(mem + addr, value, size);
+    mark_dirty_range(addr, size);
+}
+
+// Guest words as the host holds them in memory
+static inline uint32_t host_le32(uint32_t value) {
+    return HOST_LITTLE_ENDIAN ? value : __builtin_bswap32(value);
+}
+
+static inline uint64_t host_le64(uint64_t value) {
+    return HOST_LITTLE_ENDIAN ? value : __builtin_bswap64(value);
+}
+
+// One host store, so harts reading the register never see half of it
+void RISCV32::Memory32::write_device_u64(uint32_t addr, uint64_t data) {
+    __atomic_store_n((uint64_t*)(mem + addr), host_le64(data), __ATOMIC_RELAXED);
+}
+
+uint32_t RISCV32::Memory32::load_atomic_u32(uint32_t addr) {
+    if (addr & 3) MEM_ALIGN_ERR(addr);
+    return host_le32(__atomic_load_n((uint32_t*)(mem + addr), __ATOMIC_SEQ_CST));
+}
+
+bool RISCV32::Memory32::compare_swap_u32(uint32_t addr, uint32_t expected, uint32_t desired) {
+    if (addr & 3) MEM_ALIGN_ERR(addr);
+    mark_dirty(addr);
+    uint32_t raw = host_le32(expected);
+    return __atomic_compare_exchange_n((uint32_t*)(mem + addr), &raw, host_le32(desired), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+// Returns the old value; swap and the bitwise ops are single host instructions, the rest retry a compare-and-swap
+uint32_t RISCV32::Memory32::amo_u32(uint32_t addr, uint8_t op, uint32_t value) {
+    if (addr & 3) MEM_ALIGN_ERR(addr);
+    mark_dirty(addr);
+    uint32_t* word = (uint32_t*)(mem + addr);
+    switch (op) {
+        case OP_AMOSWAP_W: return host_le32(__atomic_exchange_n(word, host_le32(value), __ATOMIC_SEQ_CST));
+        case OP_AMOXOR_W: return host_le32(__atomic_fetch_xor(word, host_le32(value), __ATOMIC_SEQ_CST));
+        case OP_AMOAND_W: return host_le32(__atomic_fetch_and(word, host_le32(value), __ATOMIC_SEQ_CST));
+        case OP_AMOOR_W: return host_le32(__atomic_fetch_or(word, host_le32(value), __ATOMIC_SEQ_CST));
+        case OP_AMOADD_W: {
+            if (HOST_LITTLE_ENDIAN) return __atomic_fetch_add(word, value, __ATOMIC_SEQ_CST);
+        } break;
+        default: break;
+    }
+    uint32_t raw = __atomic_load_n(word, __ATOMIC_RELAXED);
+    while (true) {
+        uint32_t old = host_le32(raw), result;
+        switch (op) {
+            case OP_AMOADD_W: result = old + value; break;
+            case OP_AMOMIN_W: result = ((int32_t)value < (int32_t)old) ? value : old; break;
+            case OP_AMOMAX_W: result = ((int32_t)value > (int32_t)old) ? value : old; break;
+            case OP_AMOMINU_W: result = (value < old) ? value : old; break;
+            default: result = (value > old) ? value : old; break; // OP_AMOMAXU_W
+        }
+        if (__atomic_compare_exchange_n(word, &raw, host_le32(result), true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) return old;
     }
-    if (rd != 0) reg32[rd] = reg32[rs1] ^ imm;
 }
 
-void RISCV32::base_I32::ori(uint32_t rd, uint32_t rs1, uint32_t imm) {
-    if (debug_mode == 1) {
-        print_inst(pc, "ori " + std::to_string(rd) + ", " + std::to_string(rs1) + ", " + std::to_string(imm));
+// Map file pages over guest memory; private, so guest stores never reach the file
+void RISCV32::Memory32::map_file(int fd, uint32_t offset, uint32_t addr, uint32_t size, bool writable) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t len = (size + page - 1) & ~(page - 1);
+    int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    if (mmap(mem + addr, len, prot, MAP_PRIVATE | MAP_FIXED, fd, offset) == MAP_FAILED) {
+        throw std::runtime_error("Failed to map program file.");
     }
-    if (rd != 0) reg32[rd] = reg32[rs1] | imm;
+    mark_dirty_range(addr, size);
+}
+
+RISCV32::Memory32::Snapshot::~Snapshot() {
+    if (fd >= 0) close(fd);
 }
 
-void RISCV32::base_I32::andi(uint32_t rd, uint32_t rs1, uint32_t imm) {
-    if (debug_mode == 1) {
-        print_inst(pc, "andi " + std::to_string(rd) + ", " + std::to_string(rs1) + ", " + std::to_string(imm));
+// Pages written since the last save or restore in ascending order, clear to start tracking anew
+void RISCV32::Memory32::dirty_pages(std::vector<uint32_t>* pages, bool clear) {
+    const uint64_t* groups = (const uint64_t*)dirty_groups;
+    for (uint32_t w = 0; w < MEM_DIRTY_GROUP_BYTES / 8; w++) {
+        if (groups[w] == 0) continue;
+        for (uint32_t g = w * 8; g < w * 8 + 8; g++) {
+            if (!dirty_groups[g]) continue;
+            uint32_t first = g << MEM_DIRTY_GROUP_SHIFT;
+            for (uint32_t page = first; page < first + (1 << MEM_DIRTY_GROUP_SHIFT); page++) {
+                if (dirty[page]) pages->push_back(page);
+            }
+            if (clear) {
+                std::memset(dirty + first, 0, 1 << MEM_DIRTY_GROUP_SHIFT);
+                dirty_groups[g] = 0;
+            }
+        }
     }
-    if (rd != 0) reg32[rd] = reg32[rs1] & imm;
 }
 
-void RISCV32::base_I32::slli(uint32_t rd, uint32_t rs1, uint32_t shamt) {
-    if (debug_mode == 1) {
-        print_inst(pc, "slli " + std::to_string(rd) + ", " + std::to_string(rs1) + ", " + std::to_string(shamt));
+void RISCV32::Memory32::save(Snapshot* snap) {
+    // Every page that can differ from zero is in the previous snapshot or written since
+    std::vector<uint32_t> written, pages;
+    dirty_pages(&written, true);
+    std::set_union(snap->pages.begin(), snap->pages.end(), written.begin(), written.end(), std::back_inserter(pages));
+
+    int fd = memfd_create("riscv32-snapshot", 0);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to create snapshot.");
     }
-    if (rd != 0) reg32[rd] = reg32[rs1] << (shamt & 0x1F); // Only lower 5-bits matters.
+    for (size_t i = 0; i < pages.size(); ) {
+        size_t run = 1;
+        while (i + run < pages.size() && pages[i + run] == pages[i] + run) run++;
+        size_t len = run << MEM_PAGE_SHIFT;
+        if (pwrite(fd, mem + ((size_t)pages[i] << MEM_PAGE_SHIFT), len, i << MEM_PAGE_SHIFT) != (ssize_t)len) {
+            close(fd);
+            throw std::runtime_error("Failed to create snapshot.");
+        }
+        i += run;
+    }
+    if (snap->fd >= 0) close(snap->fd);
+    snap->fd = fd;
+    snap->pages.swap(pages);
 }
 
-void RISCV32::base_I32::srli(uint32_t rd, uint32_t rs1, uint32_t shamt) {
-    if (debug_mode == 1) {
-        print_inst(pc, "srli " + std::to_string(rd) + ", " + std::to_string(rs1) + ", " + std::to_string(shamt));
+void RISCV32::Memory32::restore(const Snapshot& snap) {
+    // Only pages written since are reset: snapshot pages come back copy-on-write, the rest as zero pages
+    std::vector<uint32_t> written;
+    dirty_pages(&written, true);
+    for (size_t i = 0; i < written.size(); ) {
+        std::vector<uint32_t>::const_iterator it = std::lower_bound(snap.pages.begin(), snap.pages.end(), written[i]);
+        size_t k = it - snap.pages.begin();
+        bool saved = it != snap.pages.end() && *it == written[i];
+        size_t run = 1;
+        while (i + run < written.size() && written[i + run] == written[i] + run) {
+            bool next_saved = k + run < snap.pages.size() && snap.pages[k + run] == written[i] + run;
+            if (next_saved != saved) break;
+            run++;
+        }
+        uint8_t* addr = mem + ((size_t)written[i] << MEM_PAGE_SHIFT);
+        size_t len = run << MEM_PAGE_SHIFT;
+        void* res = saved
+            ? mmap(addr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, snap.fd, k << MEM_PAGE_SHIFT)
+            : mmap(addr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+        if (res == MAP_FAILED) {
+            throw std::runtime_error("Failed to restore snapshot.");
+        }
+        for (size_t page = written[i]; page < written[i] + run; page++) {
+            if (code[page]) code_written(page << MEM_PAGE_SHIFT, 1 << MEM_PAGE_SHIFT); // old code came back
+        }
+        i += run;
     }
-    if (rd != 0) reg32[rd] = reg32[rs1] >> (shamt & 0x1F); // Only lower 5-bits matters.
 }
 
-void RISCV32::base_I32::srai(uint32_t rd, uint32_t rs1, uint32_t shamt) {
-    if (debug_mode == 1) {
-        print_inst(pc, "srai " + std::to_string(rd) + ", " + std::to_string(rs1) + ", " + std::to_string(shamt));
+// ELF layouts of both classes, the loader is the same
+struct Elf32 {
+    typedef Elf32_Ehdr Ehdr;
+    typedef Elf32_Phdr Phdr;
+    typedef Elf32_Shdr Shdr;
+    typedef Elf32_Sym Sym;
+};
+
+struct Elf64 {
+    typedef Elf64_Ehdr Ehdr;
+    typedef Elf64_Phdr Phdr;
+    typedef Elf64_Shdr Shdr;
+    typedef Elf64_Sym Sym;
+};
+
+bool RISCV32::Memory32::read_program(const char* program_file, uint32_t* entry, unsigned* xlen, uint32_t* end, std::vector<Symbol32>* symbols) {
+    int fd = open(program_file, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        throw std::runtime_error("Failed to open program file.");
+    }
+    if ((uint64_t)st.st_size > MEM_SIZE) {
+        close(fd);
+        throw std::runtime_error("Program does not fit in memory.");
+    }
+    size_t size = st.st_size;
+    *end = size;
+    if (size == 0) {
+        close(fd);
+        return false;
+    }
+
+    // Peek at the file through a read-only mapping, nothing is copied yet
+    const uint8_t* file = (const uint8_t*)mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error("Failed to map program file.");
+    }
+    bool is_elf = size >= sizeof(Elf32_Ehdr) && std::memcmp(file, ELFMAG, SELFMAG) == 0;
+    try {
+        if (is_elf && file[EI_CLASS] == ELFCLASS32) {
+            load_elf<Elf32>(fd, file, size, entry, end, symbols);
+            *xlen = 32;
+        } else if (is_elf && file[EI_CLASS] == ELFCLASS64 && size >= sizeof(Elf64_Ehdr)) {
+            load_elf<Elf64>(fd, file, size, entry, end, symbols);
+            *xlen = 64;
+        } else if (is_elf) {
+            throw std::runtime_error("Broken ELF header.");
+        } else {
+            // Flat binary, loaded at address 0
+            map_file(fd, 0, 0, size, true);
+        }
+    } catch (std::runtime_error&) {
+        munmap((void*)file, size);
+        close(fd);
+        throw;
     }
-    if (rd != 0) reg32[rd] = (int32_t)reg32[rs1] >> (shamt & 0x1F); // Only lower 5-bits matters.
+    munmap((void*)file, size);
+    close(fd);
+    return is_elf;
+}
+
+template <class Elf>
+void RISCV32::Memory32::load_elf(int fd, const uint8_t* file, size_t size, uint32_t* entry, uint32_t* end, std::vector<Symbol32>* symbols) {
+    const typename Elf::Ehdr* ehdr = (const typename Elf::Ehdr*)file;
+    if (ehdr->e_ident[EI_DATA] != ELFDATA2LSB || ehdr->e_machine != EM_RISCV) {
+        throw std::runtime_error("Not a little-endian RISC-V ELF file.");
+    }
+    if (ehdr->e_phentsize != sizeof(typename Elf::Phdr) || ehdr->e_phoff + (uint64_t)ehdr->e_phnum * sizeof(typename Elf::Phdr) > size) {
+        throw std::runtime_error("Broken ELF program headers.");
+    }
+    if (ehdr->e_entry >= MEM_SIZE) {
+        throw std::runtime_error("ELF entry point is out of memory.");
+    }
+
+    uint32_t page = sysconf(_SC_PAGESIZE);
+    uint64_t mapped_end = 0; // PT_LOAD segments come in ascending address order
+    uint64_t writable_end = 0; // end of the pages a writable segment needs
+    *end = 0;
+    for (int i = 0; i < ehdr->e_phnum; i++) {
+        const typename Elf::Phdr* phdr = (const typename Elf::Phdr*)(file + ehdr->e_phoff) + i;
+        if (phdr->p_type != PT_LOAD || phdr->p_memsz == 0) continue;
+        if (phdr->p_filesz > phdr->p_memsz || (uint64_t)phdr->p_offset + phdr->p_filesz > size
+            || phdr->p_vaddr >= MEM_SIZE || phdr->p_memsz > MEM_SIZE - phdr->p_vaddr) {
+            throw std::runtime_error("Broken ELF segment.");
+        }
+
+        uint32_t start = phdr->p_vaddr & ~(page - 1);
+        uint32_t delta = phdr->p_vaddr - start;
+        uint64_t file_end = (uint64_t)phdr->p_vaddr + phdr->p_filesz;
+        uint64_t page_end = (file_end + page - 1) & ~(uint64_t)(page - 1);
+        uint64_t memory_end = (uint64_t)phdr->p_vaddr + phdr->p_memsz;
+        bool writable = phdr->p_flags & PF_W;
+        if (phdr->p_filesz == 0) {
+            // Pure .bss, the reserved pages are already zero but may share one with a read-only segment
+            if (writable && start < mapped_end) mprotect(mem + start, page_end - start, PROT_READ | PROT_WRITE);
+        } else if (phdr->p_offset % page == delta && start >= mapped_end) {
+            map_file(fd, phdr->p_offset - delta, start, delta + phdr->p_filesz, writable);
+            // The rest of the last page holds unrelated file bytes; clear them for .bss
+            if (page_end > file_end) {
+                if (!writable) mprotect(mem + start, page_end - start, PROT_READ | PROT_WRITE);
+                fill(file_end, 0, page_end - file_end);
+                if (!writable) mprotect(mem + start, page_end - start, PROT_READ);
+            }
+        } else {
+            // Shares a page with the previous segment or is not page-congruent; copy it
+            mprotect(mem + start, page_end - start, PROT_READ | PROT_WRITE);
+            write_block(phdr->p_vaddr, file + phdr->p_offset, phdr->p_filesz);
+            if (!writable) {
+                // A page shared with an earlier writable segment has to stay writable
+                uint64_t from = start < writable_end ? writable_end : start;
+                if (from < page_end) mprotect(mem + from, page_end - from, PROT_READ);
+            }
+        }
+        if (writable && page_end > writable_end) writable_end = page_end;
+        // Pages past the file part stay demand-zero
+        mapped_end = page_end > mapped_end ? page_end : mapped_end;
+        if (memory_end > *end) *end = (memory_end > UINT32_MAX) ? UINT32_MAX : memory_end;
+    }
+    *entry = ehdr->e_entry;
+
+    // Code symbols for the profiler, from the first symbol table if the file has one
+    if (ehdr->e_shentsize != sizeof(typename Elf::Shdr) || ehdr->e_shoff + (uint64_t)ehdr->e_shnum * sizeof(typename Elf::Shdr) > size) return;
+    const typename Elf::Shdr* shdrs = (const typename Elf::Shdr*)(file + ehdr->e_shoff);
+    for (int i = 0; i < ehdr->e_shnum; i++) {
+        if (shdrs[i].sh_type != SHT_SYMTAB || shdrs[i].sh_link >= ehdr->e_shnum) continue;
+        const typename Elf::Shdr& strtab = shdrs[shdrs[i].sh_link];
+        if ((uint64_t)shdrs[i].sh_offset + shdrs[i].sh_size > size || (uint64_t)strtab.sh_offset + strtab.sh_size > size) break;
+        const typename Elf::Sym* syms = (const typename Elf::Sym*)(file + shdrs[i].sh_offset);
+        for (size_t k = 0; k < shdrs[i].sh_size / sizeof(typename Elf::Sym); k++) {
+            int type = ELF32_ST_TYPE(syms[k].st_info); // the same for both classes
+            if ((type != STT_FUNC && type != STT_NOTYPE) || syms[k].st_shndx == SHN_UNDEF || syms[k].st_shndx >= SHN_LORESERVE) continue;
+            if (syms[k].st_value >= MEM_SIZE) continue;
+            if (syms[k].st_name == 0 || syms[k].st_name >= strtab.sh_size) continue;
+            const char* name = (const char*)file + strtab.sh_offset + syms[k].st_name;
+            Symbol32 sym = { (uint32_t)syms[k].st_value, (uint32_t)syms[k].st_size, std::string(name, strnlen(name, strtab.sh_size - syms[k].st_name)) };
+            symbols->push_back(sym);
+        }
+        std::sort(symbols->begin(), symbols->end(), [](const Symbol32& a, const Symbol32& b) { return a.addr < b.addr; });
+        break;
+    }
+}
+
+void RISCV32::Memory32::print_mem_all() {
+    std::cout << "Memory" << std::endl;
+    std::cout << "  Address |   Data" << std::endl;
+    std::cout << "--------------------" << std::endl;
+    std::vector<uint8_t> dump(MEM_DUMP_SIZE);
+    read_block(0, dump.data(), dump.size());
+    for (int i = 0; i < MEM_DUMP_SIZE / 4; i++) {
+        std::cout << " ";
+        std::cout.width(8);
+        std::cout << std::hex << i << " | ";
+        uint32_t data = load_le32(&dump[i * 4]);
+        std::cout.width(8);
+        std::cout.fill('0');
+        std::cout << std::hex << data << std::endl;
+    }
+}
+
+// Runs of consecutive pages as [first, last] pairs
+static void page_runs(const std::vector<uint32_t>& pages, std::vector<std::pair<uint32_t, uint32_t> >* runs) {
+    for (size_t i = 0; i < pages.size(); i++) {
+        if (!runs->empty() && runs->back().second + 1 == pages[i]) runs->back().second = pages[i];
+        else runs->push_back(std::make_pair(pages[i], pages[i]));
+    }
+}
+
+void RISCV32::Memory32::print_pages(const std::vector<uint32_t>& pages) {
+    std::vector<std::pair<uint32_t, uint32_t> > runs;
+    page_runs(pages, &runs);
+    // Formatted up front and written at once
+    std::string out = "Memory\n  Address |   Data\n--------------------\n";
+    char line[32];
+    for (size_t r = 0; r < runs.size(); r++) {
+        if (r > 0) out += "       ...\n";
+        uint64_t end = (uint64_t)(runs[r].second + 1) << MEM_PAGE_SHIFT;
+        for (uint64_t addr = (uint64_t)runs[r].first << MEM_PAGE_SHIFT; addr < end; addr += 4) {
+            snprintf(line, sizeof(line), " %08x | %08x\n", (uint32_t)addr, load_le32(mem + addr));
+            out += line;
+        }
+    }
+    std::cout << out;
+    std::cout.flush();
+}
+
+// Raw images hold regions as a little-endian address and byte count followed by the bytes,
+// hex images are Intel HEX with extended linear address records
+void RISCV32::Memory32::write_image(const std::string& path, const std::vector<uint32_t>& pages, bool hex) {
+    std::vector<std::pair<uint32_t, uint32_t> > runs;
+    page_runs(pages, &runs);
+    std::string out;
+    for (size_t r = 0; r < runs.size(); r++) {
+        uint64_t start = (uint64_t)runs[r].first << MEM_PAGE_SHIFT;
+        uint64_t end = (uint64_t)(runs[r].second + 1) << MEM_PAGE_SHIFT;
+        if (!hex) {
+            // Split so every byte count fits in 32 bits
+            for (uint64_t at = start; at < end; at += 0x80000000ULL) {
+                uint32_t size = std::min<uint64_t>(end - at, 0x80000000ULL);
+                uint8_t header[8];
+                store_le32(header, (uint32_t)at);
+                store_le32(header + 4, size);
+                out.append((const char*)header, 8);
+                out.append((const char*)mem + at, size);
+            }
+            continue;
+        }
+        char rec[64];
+        for (uint64_t at = start; at < end; at += 16) {
+            if (at == start || (at & 0xFFFF) == 0) {
+                uint8_t sum = 2 + 4 + (at >> 24) + ((at >> 16) & 0xFF);
+                snprintf(rec, sizeof(rec), ":02000004%04X%02X\n", (unsigned)(at >> 16), (uint8_t)-sum);
+                out += rec;
+            }
+            uint8_t sum = 16 + ((at >> 8) & 0xFF) + (at & 0xFF);
+            int len = snprintf(rec, sizeof(rec), ":10%04X00", (unsigned)(at & 0xFFFF));
+            for (int i = 0; i < 16; i++) {
+                len += snprintf(rec + len, sizeof(rec) - len, "%02X", mem[at + i]);
+                sum += mem[at + i];
+            }
+            snprintf(rec + len, sizeof(rec) - len, "%02X\n", (uint8_t)-sum);
+            out += rec;
+        }
+    }
+    if (hex) out += ":00000001FF\n";
+
+    FILE* file = fopen(path.c_str(), "wb");
+    if (file == nullptr) {
+        throw std::runtime_error("Failed to open memory image file.");
+    }
+    size_t written = fwrite(out.data(), 1, out.size(), file);
+    fclose(file);
+    if (written != out.size()) {
+        throw std::runtime_error("Failed to write memory image file.");
+    }
+}
+
+void RISCV32::Memory32::print_mem_u8(uint32_t addr) {
+    uint8_t data;
+    read_mem_u8<false>(addr, &data);
+    std::cout << "Memory[" << addr << "]: " << std::hex << (int)data << std::endl;
+}
+
+void RISCV32::Memory32::print_mem_u16(uint32_t addr) {
+    uint16_t data;
+    read_mem_u16<false>(addr, &data);
+    std::cout << "Memory[" << addr << "]: " << std::hex << (int)data << std::endl;
+}
+
+void RISCV32::Memory32::print_mem_u32(uint32_t addr) {
+    uint32_t data;
+    read_mem_u32<false>(addr, &data);
+    std::cout << "Memory[" << addr << "]: " << std::hex << (int)data << std::endl;
+}
+
+// x registers
+template <class Cfg>
+inline typename Cfg::uxlen RISCV32::read_x(uint8_t reg) const {
+    return (typename Cfg::uxlen)xreg[reg];
+}
+
+template <class Cfg>
+inline typename Cfg::sxlen RISCV32::read_sx(uint8_t reg) const {
+    return (typename Cfg::sxlen)xreg[reg];
+}
+
+template <class Cfg>
+inline void RISCV32::write_x(uint8_t reg, typename Cfg::uxlen value) {
+    if (reg != 0) xreg[reg] = value;
+}
+
+template <class Cfg>
+inline void RISCV32::write_w(uint8_t reg, uint32_t value) {
+    write_x<Cfg>(reg, (typename Cfg::uxlen)(typename Cfg::sxlen)(int32_t)value);
+}
+
+template <class Cfg>
+inline typename Cfg::uxlen RISCV32::imm_x(const Decoded32& inst) {
+    return (typename Cfg::uxlen)(typename Cfg::sxlen)(int32_t)inst.imm;
+}
+
+template <class Cfg>
+inline uint32_t RISCV32::guest_addr(typename Cfg::uxlen addr) {
+    if (Cfg::xlen == 64 && (uint64_t)addr >> 32 != 0) MEM_OUT_ERR(addr);
+    return (uint32_t)addr;
+}
+
+template <class Cfg>
+inline uint32_t RISCV32::effective_addr(const Decoded32& inst) const {
+    return guest_addr<Cfg>(read_x<Cfg>(inst.rs1) + imm_x<Cfg>(inst));
+}
+
+// U-type
+template <class Cfg>
+void RISCV32::base_I32::lui(RISCV32& hart, const Decoded32& inst) {
+    hart.write_x<Cfg>(inst.rd, imm_x<Cfg>(inst));
+}
+
+template <class Cfg>
+void RISCV32::base_I32::auipc(RISCV32& hart, const Decoded32& inst) {
+    hart.write_x<Cfg>(inst.rd, inst.pc + imm_x<Cfg>(inst));
+}
+
+// J-type
+template <class Cfg>
+void RISCV32::base_I32::jal(RISCV32& hart, const Decoded32& inst) {
+    hart.jump_to(inst.pc + (int32_t)inst.imm);
+    hart.write_x<Cfg>(inst.rd, inst.pc + inst.len);
+}
+
+// I-type
+template <class Cfg>
+void RISCV32::base_I32::jalr(RISCV32& hart, const Decoded32& inst) {
+    hart.jump_to(guest_addr<Cfg>((hart.read_x<Cfg>(inst.rs1) + imm_x<Cfg>(inst)) & ~(typename Cfg::uxlen)1));
+    hart.write_x<Cfg>(inst.rd, inst.pc + inst.len);
+}
+
+// B-type
+template <class Cfg>
+void RISCV32::base_I32::beq(RISCV32& hart, const Decoded32& inst) {
+    if (hart.read_x<Cfg>(inst.rs1) == hart.read_x<Cfg>(inst.rs2)) {
+        hart.jump_to(inst.pc + (int32_t)inst.imm);
+    }
+}
+
+template <class Cfg>
+void RISCV32::base_I32::bne(RISCV32& hart, const Decoded32& inst) {
+    if (hart.read_x<Cfg>(inst.rs1) != hart.read_x<Cfg>(inst.rs2)) {
+        hart.jump_to(inst.pc + (int32_t)inst.imm);
+    }
+}
+
+template <class Cfg>
+void RISCV32::base_I32::blt(RISCV32& hart, const Decoded32& inst) {
+    if (hart.read_sx<Cfg>(inst.rs1) < hart.read_sx<Cfg>(inst.rs2)) {
+        hart.jump_to(inst.pc + (int32_t)inst.imm);
+    }
+}
+
+template <class Cfg>
+void RISCV32::base_I32::bge(RISCV32& hart, const Decoded32& inst) {
+    if (hart.read_sx<Cfg>(inst.rs1) >= hart.read_sx<Cfg>(inst.rs2)) {
+        hart.jump_to(inst.pc + (int32_t)inst.imm);
+    }
+}
+
+template <class Cfg>
+void RISCV32::base_I32::bltu(RISCV32& hart, const Decoded32& inst) {
+    if (hart.read_x<Cfg>(inst.rs1) < hart.read_x<Cfg>(inst.rs2)) {
+        hart.jump_to(inst.pc + (int32_t)inst.imm);
+    }
+}
+
+template <class Cfg>
+void RISCV32::base_I32::bgeu(RISCV32& hart, const Decoded32& inst) {
+    if (hart.read_x<Cfg>(inst.rs1) >= hart.read_x<Cfg>(inst.rs2)) {
+        hart.jump_to(inst.pc + (int32_t)inst.imm);
+    }
+}
+
+// I-type
+template <class Cfg>
+void RISCV32::base_I32::lb(RISCV32& hart, const Decoded32& inst) {
+    uint8_t data;
+    hart.memory.read_mem_u8<Cfg::align>(hart.effective_addr<Cfg>(inst), &data);
+    hart.write_w<Cfg>(inst.rd, (int32_t)(int8_t)data);
+}
+
+template <class Cfg>
+void RISCV32::base_I32::lh(RISCV32& hart, const Decoded32& inst) {
+    uint16_t data;
+    hart.memory.read_mem_u16<Cfg::align>(hart.effective_addr<Cfg>(inst), &data);
+    hart.write_w<Cfg>(inst.rd, (int32_t)(int16_t)data);
+}
+
+template <class Cfg>
+void RISCV32::base_I32::lw(RISCV32& hart, const Decoded32& inst) {
+    uint32_t data;
+    hart.memory.read_mem_u32<Cfg::align>(hart.effective_addr<Cfg>(inst), &data);
+    hart.write_w<Cfg>(inst.rd, data);
+}
+
+template <class Cfg>
+void RISCV32::base_I32::lbu(RISCV32& hart, const Decoded32& inst) {
+    uint8_t data;
+    hart.memory.read_mem_u8<Cfg::align>(hart.effective_addr<Cfg>(inst), &data);
+    hart.write_x<Cfg>(inst.rd, data);
+}
+
+template <class Cfg>
+void RISCV32::base_I32::lhu(RISCV32& hart, const Decoded32& inst) {
+    uint16_t data;
+    hart.memory.read_mem_u16<Cfg::align>(hart.effective_addr<Cfg>(inst), &data);
+    hart.write_x<Cfg>(inst.rd, data);
+}
+
+// S-type
+template <class Cfg>
+void RISCV32::base_I32::sb(RISCV32& hart, const Decoded32& inst) {
+    hart.memory.write_mem_u8<Cfg::align>(hart.effective_addr<Cfg>(inst), hart.read_x<Cfg>(inst.rs2) & 0xFF);
+}
+
+template <class Cfg>
+void RISCV32::base_I32::sh(RISCV32& hart, const Decoded32& inst) {
+    hart.memory.write_mem_u16<Cfg::align>(hart.effective_addr<Cfg>(inst), hart.read_x<Cfg>(inst.rs2) & 0xFFFF);
+}
+
+template <class Cfg>
+void RISCV32::base_I32::sw(RISCV32& hart, const Decoded32& inst) {
+    hart.memory.write_mem_u32<Cfg::align>(hart.effective_addr<Cfg>(inst), (uint32_t)hart.read_x<Cfg>(inst.rs2));
+}
+
+// I-type
+template <class Cfg>
+void RISCV32::base_I32::addi(RISCV32& hart, const Decoded32& inst) {
+    hart.write_x<Cfg>(inst.rd, hart.read_x<Cfg>(inst.rs1) + imm_x<Cfg>(inst));
+}
+
+template <class Cfg>
+void RISCV32::base_I32::slti(RISCV32& hart, const Decoded32& inst) {
+    hart.write_x<Cfg>(inst.rd, hart.read_sx<Cfg>(inst.rs1) < (typename Cfg::sxlen)imm_x<Cfg>(inst) ? 1 : 0);
+}
+
+template <class Cfg>
+void RISCV32::base_I32::sltiu(RISCV32& hart, const Decoded32& inst) {
+    hart.write_x<Cfg>(inst.rd, hart.read_x<Cfg>(inst.rs1) < imm_x<Cfg>(inst) ? 1 : 0);
+}
+
+template <class Cfg>
+void RISCV32::base_I32::xori(RISCV32& hart, const Decoded32& inst) {
+    hart.write_x<Cfg>(inst.rd, hart.read_x<Cfg>(inst.rs1) ^ imm_x<Cfg>(inst));
+}
+
+template <class Cfg>
+void RISCV32::base_I32::ori(RISCV32& hart, const Decoded32& inst) {
+    hart.write_x<Cfg>(inst.rd, hart.read_x<Cfg>(inst.rs1) | imm_x<Cfg>(inst));
+}
+
+template <class Cfg>
+void RISCV32::base_I32::andi(RISCV32& hart, const Decoded32& inst) {
+    hart.write_x<Cfg>(inst.rd, hart.read_x<Cfg>(inst.rs1) & imm_x<Cfg>(inst));
+}
+
+template <class Cfg>
+void RISCV32::base_I32::slli(RISCV32& hart, const Decoded32& inst) {
+    hart.write_x<Cfg>(inst.rd, hart.read_x<Cfg>(inst.rs1) << (inst.imm & (Cfg::xlen - 1))); // shamt is 5 bits on RV32, 6 on RV64
+}
+
+template <class Cfg>
+void RISCV32::base_I32::srli(RISCV32& hart, const Decoded32& inst) {
+    hart.write_x<Cfg>(inst.rd, hart.read_x<Cfg>(inst.rs1) >> (inst.imm & (Cfg::xlen - 1))); // shamt is 5 bits on RV32, 6 on RV64
+}
+
+template <class Cfg>
+void RISCV32::base_I32::srai(RISCV32& hart, const Decoded32& inst) {
+    hart.write_x<Cfg>(inst.rd, hart.read_sx<Cfg>(inst.rs1) >> (inst.imm & (Cfg::xlen - 1))); // shamt is 5 bits on RV32, 6 on RV64
 }
 
 // R-type
-void RISCV32::base_I32::add(uint32_t rd, uint32_t rs1, uint32_t rs2) {
-    if (debug_mode == 1) {
-        print_inst(pc, "add " + std::to_string(rd) + ", " + std::to_string(rs1) + ", " + std::to_string(rs2));
+template <class Cfg>
+void RISCV32::base_I32::add(RISCV32& hart, const Decoded32& inst) {
+    hart.write_x<Cfg>(inst.rd, hart.read_x<Cfg>(inst.rs1) + hart.read_x<Cfg>(inst.rs2));
+}
+
+template <class Cfg>
+void RISCV32::base_I32::sub(RISCV32& hart, const Decoded32& inst) {
+    hart.write_x<Cfg>(inst.rd, hart.read_x<Cfg>(inst.rs1) - hart.read_x<Cfg>(inst.rs2));
+}
+
+template <class Cfg>
+void RISCV32::base_I32::sll(RISCV32& hart, const Decoded32& inst) {
+    hart.write_x<Cfg>(inst.rd, hart.read_x<Cfg>(inst.rs1) << (hart.read_x<Cfg>(inst.rs2) & (Cfg::xlen - 1))); // Only the low log2(XLEN) bits matter.
+}
+
+template <class Cfg>
+void RISCV32::base_I32::slt(RISCV32& hart, const Decoded32& inst) {
+    hart.write_x<Cfg>(inst.rd, hart.read_sx<Cfg>(inst.rs1) < hart.read_sx<Cfg>(inst.rs2) ? 1 : 0);
+}
+
+template <class Cfg>
+void RISCV32::base_I32::sltu(RISCV32& hart, const Decoded32& inst) {
+    hart.write_x<Cfg>(inst.rd, hart.read_x<Cfg>(inst.rs1) < hart.read_x<Cfg>(inst.rs2) ? 1 : 0);
+}
+
+template <class Cfg>
+void RISCV32::base_I32::xor_(RISCV32& hart, const Decoded32& inst) {
+    hart.write_x<Cfg>(inst.rd, hart.read_x<Cfg>(inst.rs1) ^ hart.read_x<Cfg>(inst.rs2));
+}
+
+template <class Cfg>
+void RISCV32::base_I32::srl(RISCV32& hart, const Decoded32& inst) {
+    hart.write_x<Cfg>(inst.rd, hart.read_x<Cfg>(inst.rs1) >> (hart.read_x<Cfg>(inst.rs2) & (Cfg::xlen - 1))); // Only the low log2(XLEN) bits matter.
+}
+
+template <class Cfg>
+void RISCV32::base_I32::sra(RISCV32& hart, const Decoded32& inst) {
+    hart.write_x<Cfg>(inst.rd, hart.read_sx<Cfg>(inst.rs1) >> (hart.read_x<Cfg>(inst.rs2) & (Cfg::xlen - 1))); // Only the low log2(XLEN) bits matter.
+}
+
+template <class Cfg>
+void RISCV32::base_I32::or_(RISCV32& hart, const Decoded32& inst) {
+    hart.write_x<Cfg>(inst.rd, hart.read_x<Cfg>(inst.rs1) | hart.read_x<Cfg>(inst.rs2));
+}
+
+template <class Cfg>
+void RISCV32::base_I32::and_(RISCV32& hart, const Decoded32& inst) {
+    hart.write_x<Cfg>(inst.rd, hart.read_x<Cfg>(inst.rs1) & hart.read_x<Cfg>(inst.rs2));
+}
+
+template <class Cfg>
+void RISCV32::base_I32::fence(RISCV32&, const Decoded32&) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+// Own stores have already dropped the code they hit; what other harts wrote is not known by address
+template <class Cfg>
+void RISCV32::base_I32::fence_i(RISCV32& hart, const Decoded32&) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t stores = hart.memory.code_stores_elsewhere();
+    if (stores != hart.code_stores_seen) {
+        hart.code_stores_seen = stores;
+        hart.flush_code();
+    }
+}
+
+template <class Cfg>
+void RISCV32::base_I32::slt_branch(RISCV32& hart, const Decoded32& inst) {
+    bool less = (inst.op == OP_SLT_BEQ || inst.op == OP_SLT_BNE)
+        ? hart.read_sx<Cfg>(inst.rs1) < hart.read_sx<Cfg>(inst.rs2)
+        : hart.read_x<Cfg>(inst.rs1) < hart.read_x<Cfg>(inst.rs2);
+    hart.write_x<Cfg>(inst.rd, less ? 1 : 0);
+    if (less == (inst.op == OP_SLT_BNE || inst.op == OP_SLTU_BNE)) {
+        hart.jump_to(inst.pc + (int32_t)inst.imm);
+    }
+}
+
+// Arguments and result at the width of the core
+template <class Cfg>
+void RISCV32::Syscall32::ecall(RISCV32& hart, const Decoded32&) {
+    uint64_t args[6];
+    for (int i = 0; i < 6; i++) args[i] = hart.read_x<Cfg>(10 + i);
+    hart.write_x<Cfg>(10, hart.sys->call(hart, hart.read_x<Cfg>(17), args));
+}
+
+// RV64I, only reachable from the 64-bit cores
+template <class Cfg>
+void RISCV32::base_I64::lwu(RISCV32& hart, const Decoded32& inst) {
+    uint32_t data;
+    hart.memory.read_mem_u32<Cfg::align>(hart.effective_addr<Cfg>(inst), &data);
+    hart.write_x<Cfg>(inst.rd, data);
+}
+
+template <class Cfg>
+void RISCV32::base_I64::ld(RISCV32& hart, const Decoded32& inst) {
+    uint64_t data;
+    hart.memory.read_mem_u64<Cfg::align>(hart.effective_addr<Cfg>(inst), &data);
+    hart.write_x<Cfg>(inst.rd, data);
+}
+
+template <class Cfg>
+void RISCV32::base_I64::sd(RISCV32& hart, const Decoded32& inst) {
+    hart.memory.write_mem_u64<Cfg::align>(hart.effective_addr<Cfg>(inst), hart.read_x<Cfg>(inst.rs2));
+}
+
+template <class Cfg>
+void RISCV32::base_I64::addiw(RISCV32& hart, const Decoded32& inst) {
+    hart.write_w<Cfg>(inst.rd, (uint32_t)hart.read_x<Cfg>(inst.rs1) + inst.imm);
+}
+
+template <class Cfg>
+void RISCV32::base_I64::slliw(RISCV32& hart, const Decoded32& inst) {
+    hart.write_w<Cfg>(inst.rd, (uint32_t)hart.read_x<Cfg>(inst.rs1) << (inst.imm & 0x1F));
+}
+
+template <class Cfg>
+void RISCV32::base_I64::srliw(RISCV32& hart, const Decoded32& inst) {
+    hart.write_w<Cfg>(inst.rd, (uint32_t)hart.read_x<Cfg>(inst.rs1) >> (inst.imm & 0x1F));
+}
+
+template <class Cfg>
+void RISCV32::base_I64::sraiw(RISCV32& hart, const Decoded32& inst) {
+    hart.write_w<Cfg>(inst.rd, (int32_t)hart.read_x<Cfg>(inst.rs1) >> (inst.imm & 0x1F));
+}
+
+template <class Cfg>
+void RISCV32::base_I64::addw(RISCV32& hart, const Decoded32& inst) {
+    hart.write_w<Cfg>(inst.rd, (uint32_t)hart.read_x<Cfg>(inst.rs1) + (uint32_t)hart.read_x<Cfg>(inst.rs2));
+}
+
+template <class Cfg>
+void RISCV32::base_I64::subw(RISCV32& hart, const Decoded32& inst) {
+    hart.write_w<Cfg>(inst.rd, (uint32_t)hart.read_x<Cfg>(inst.rs1) - (uint32_t)hart.read_x<Cfg>(inst.rs2));
+}
+
+template <class Cfg>
+void RISCV32::base_I64::sllw(RISCV32& hart, const Decoded32& inst) {
+    hart.write_w<Cfg>(inst.rd, (uint32_t)hart.read_x<Cfg>(inst.rs1) << (hart.read_x<Cfg>(inst.rs2) & 0x1F));
+}
+
+template <class Cfg>
+void RISCV32::base_I64::srlw(RISCV32& hart, const Decoded32& inst) {
+    hart.write_w<Cfg>(inst.rd, (uint32_t)hart.read_x<Cfg>(inst.rs1) >> (hart.read_x<Cfg>(inst.rs2) & 0x1F));
+}
+
+template <class Cfg>
+void RISCV32::base_I64::sraw(RISCV32& hart, const Decoded32& inst) {
+    hart.write_w<Cfg>(inst.rd, (int32_t)hart.read_x<Cfg>(inst.rs1) >> (hart.read_x<Cfg>(inst.rs2) & 0x1F));
+}
+
+// Zicsr
+uint64_t RISCV32::read_csr(uint32_t csr) {
+    switch (csr) {
+        case CSR_MHARTID: return hartid;
+        case CSR_MSTATUS: return trap.mstatus;
+        case CSR_MIE: return trap.mie;
+        case CSR_MTVEC: return trap.mtvec;
+        case CSR_MSCRATCH: return trap.mscratch;
+        case CSR_MEPC: return trap.mepc;
+        case CSR_MCAUSE: return trap.mcause;
+        case CSR_MTVAL: return trap.mtval;
+        case CSR_MIP: return timer_pending() ? MIP_MTIP : 0;
+        default: break;
+    }
+    if (csr >= CSR_FFLAGS && csr <= CSR_FCSR) {
+        if (!ext.F) INSTR_ERR;
+        sync_fflags();
+        if (csr == CSR_FFLAGS) return fflags;
+        if (csr == CSR_FRM) return frm;
+        return (frm << 5) | fflags;
+    }
+    if ((csr & CSR_HIGH) && xlen == 64) INSTR_ERR; // RV64 reads whole counters
+    uint64_t value = get_counter(csr & ~CSR_HIGH);
+    return (csr & CSR_HIGH) ? value >> 32 : value;
+}
+
+void RISCV32::write_csr(uint32_t csr, uint64_t value) {
+    switch (csr) {
+        case CSR_MSTATUS: {
+            trap.mstatus = (value & (MSTATUS_MIE | MSTATUS_MPIE)) | MSTATUS_MPP;
+            next_event = 0; // a pending interrupt may be enabled now
+        } return;
+        case CSR_MIE: {
+            trap.mie = value & MIP_MTIP;
+            next_event = 0;
+        } return;
+        case CSR_MTVEC: {
+            trap.mtvec = value & ~(uint64_t)2; // direct or vectored
+        } return;
+        case CSR_MSCRATCH: {
+            trap.mscratch = value;
+        } return;
+        case CSR_MEPC: {
+            trap.mepc = value & ~(uint64_t)(ext.C ? 1 : 3);
+        } return;
+        case CSR_MCAUSE: {
+            trap.mcause = value;
+        } return;
+        case CSR_MTVAL: {
+            trap.mtval = value;
+        } return;
+        case CSR_MIP: {
+            // MTIP follows the timer, writes leave it alone
+        } return;
+        default: break;
+    }
+    // Besides the trap and floating-point csrs, every implemented csr is a read-only counter
+    if (csr < CSR_FFLAGS || csr > CSR_FCSR || !ext.F) INSTR_ERR;
+    std::feclearexcept(FE_ALL_EXCEPT);
+    if (csr == CSR_FFLAGS) fflags = value & 0x1F;
+    else if (csr == CSR_FRM) frm = value & 0x7;
+    else {
+        fflags = value & 0x1F;
+        frm = (value >> 5) & 0x7;
+    }
+}
+
+// The run loop adds a block to the counters when it ends; a csr ends its block,
+// so a guest read adds everything in the block but the csr itself
+uint64_t RISCV32::get_counter(uint32_t csr) {
+    const Block32* block = (executing != nullptr) ? current : nullptr;
+    uint64_t retired = instret + (block ? block->retired - 1 : 0);
+    switch (csr) {
+        case CSR_CYCLE: return retired; // one cycle per instruction
+        case CSR_TIME: return (retired + idle) / CLINT_TICK; // mtime, as of this instruction
+        case CSR_INSTRET: return retired;
+        case CSR_LOADS: return counters.loads + (block ? block->loads : 0);
+        case CSR_STORES: return counters.stores + (block ? block->stores : 0);
+        case CSR_TAKEN_BRANCHES: return counters.taken_branches; // only the last record branches
+        case CSR_DECODE_MISSES: return counters.decode_misses;
+        case CSR_FUSED_PAIRS: return counters.fused_pairs + (block ? block->fused : 0);
+        default: INSTR_ERR;
+    }
+}
+
+void RISCV32::print_counters() {
+    std::cout << std::dec;
+    std::cout << "Counters" << std::endl;
+    std::cout << "--------------------" << std::endl;
+    std::cout << "cycle          " << get_counter(CSR_CYCLE) << std::endl;
+    std::cout << "time           " << get_counter(CSR_TIME) << std::endl;
+    std::cout << "instret        " << get_counter(CSR_INSTRET) << std::endl;
+    std::cout << "loads          " << get_counter(CSR_LOADS) << std::endl;
+    std::cout << "stores         " << get_counter(CSR_STORES) << std::endl;
+    std::cout << "taken branches " << get_counter(CSR_TAKEN_BRANCHES) << std::endl;
+    std::cout << "decode misses  " << get_counter(CSR_DECODE_MISSES) << std::endl;
+    std::cout << "fused pairs    " << get_counter(CSR_FUSED_PAIRS) << std::endl;
+}
+
+// rd gets the old value, which is read unless rd is x0 for the write forms;
+// the set/clear forms only write when the mask comes from a register other than x0 or a non-zero immediate
+template <class Cfg>
+void RISCV32::Zicsr32::csrrw(RISCV32& hart, const Decoded32& inst) {
+    typename Cfg::uxlen value = hart.read_x<Cfg>(inst.rs1);
+    typename Cfg::uxlen old = (inst.rd != 0) ? hart.read_csr(inst.imm) : 0;
+    hart.write_csr(inst.imm, value);
+    hart.write_x<Cfg>(inst.rd, old);
+}
+
+template <class Cfg>
+void RISCV32::Zicsr32::csrrs(RISCV32& hart, const Decoded32& inst) {
+    typename Cfg::uxlen mask = hart.read_x<Cfg>(inst.rs1);
+    typename Cfg::uxlen old = hart.read_csr(inst.imm);
+    if (inst.rs1 != 0) hart.write_csr(inst.imm, old | mask);
+    hart.write_x<Cfg>(inst.rd, old);
+}
+
+template <class Cfg>
+void RISCV32::Zicsr32::csrrc(RISCV32& hart, const Decoded32& inst) {
+    typename Cfg::uxlen mask = hart.read_x<Cfg>(inst.rs1);
+    typename Cfg::uxlen old = hart.read_csr(inst.imm);
+    if (inst.rs1 != 0) hart.write_csr(inst.imm, old & ~mask);
+    hart.write_x<Cfg>(inst.rd, old);
+}
+
+template <class Cfg>
+void RISCV32::Zicsr32::csrrwi(RISCV32& hart, const Decoded32& inst) {
+    typename Cfg::uxlen old = (inst.rd != 0) ? hart.read_csr(inst.imm) : 0;
+    hart.write_csr(inst.imm, inst.rs1);
+    hart.write_x<Cfg>(inst.rd, old);
+}
+
+template <class Cfg>
+void RISCV32::Zicsr32::csrrsi(RISCV32& hart, const Decoded32& inst) {
+    typename Cfg::uxlen old = hart.read_csr(inst.imm);
+    if (inst.rs1 != 0) hart.write_csr(inst.imm, old | inst.rs1);
+    hart.write_x<Cfg>(inst.rd, old);
+}
+
+template <class Cfg>
+void RISCV32::Zicsr32::csrrci(RISCV32& hart, const Decoded32& inst) {
+    typename Cfg::uxlen old = hart.read_csr(inst.imm);
+    if (inst.rs1 != 0) hart.write_csr(inst.imm, old & ~(typename Cfg::uxlen)inst.rs1);
+    hart.write_x<Cfg>(inst.rd, old);
+}
+
+// Machine-mode traps; mepc is the pc of the next block, the instruction to return to
+void RISCV32::enter_trap(bool interrupt, uint32_t code, uint64_t tval) {
+    trap.mcause = ((uint64_t)interrupt << (xlen - 1)) | code;
+    trap.mepc = pc;
+    trap.mtval = tval;
+    trap.mstatus = ((trap.mstatus & MSTATUS_MIE) ? MSTATUS_MPIE : 0) | MSTATUS_MPP;
+    uint64_t base = trap.mtvec & ~(uint64_t)3;
+    pc = (interrupt && (trap.mtvec & 1)) ? base + 4 * code : base; // vectored mode spreads interrupts
+}
+
+// The faulting record does not retire; the ones before it in its block did. A fault without a
+// handler, or in the first instruction of the handler, is left to the caller
+template <class Cfg>
+bool RISCV32::take_fault(const Decoded32& inst) {
+    uint64_t base = trap.mtvec & ~(uint64_t)3;
+    if (base == 0 || inst.pc == base) return false;
+    uint64_t before = instret;
+    for (const Decoded32* prior = current->insts.data(); prior != &inst; prior++) instret += prior->count;
+    pc = inst.pc;
+    if (inst.count == 2) { // only the second half of a fused pair can fault
+        const Decoded32& first = fetch_decoded<Cfg>(inst.pc);
+        first.handler(*this, first);
+        instret++;
+        pc += first.len;
     }
-    if (rd != 0) reg32[rd] = reg32[rs1] + reg32[rs2];
+    if (profiling) profile_samples(current, instret - before);
+
+    bool store = (inst.op >= OP_SB && inst.op <= OP_SW) || inst.op == OP_SD || inst.op == OP_FSW
+        || (inst.op >= OP_SC_W && inst.op <= OP_AMOMAXU_W);
+    uint32_t code;
+    uint64_t tval = fault_tval;
+    switch (fault_kind) {
+        case FAULT_ILLEGAL: {
+            uint32_t instr;
+            uint16_t parcel;
+            fetch_instr<Cfg>(pc, &instr, &parcel);
+            code = CAUSE_ILLEGAL_INSTRUCTION;
+            tval = (parcel != 0) ? parcel : instr;
+        } break;
+        case FAULT_MISALIGNED: {
+            code = store ? CAUSE_MISALIGNED_STORE : CAUSE_MISALIGNED_LOAD;
+        } break;
+        case FAULT_MISALIGNED_JUMP: {
+            code = CAUSE_MISALIGNED_FETCH;
+        } break;
+        default: {
+            code = (inst.op == OP_JALR) ? CAUSE_FETCH_ACCESS : store ? CAUSE_STORE_ACCESS : CAUSE_LOAD_ACCESS;
+        } break;
+    }
+    enter_trap(false, code, tval);
+    return true;
+}
+
+template <class Cfg>
+void RISCV32::Machine32::mret(RISCV32& hart, const Decoded32&) {
+    Trap32& trap = hart.trap;
+    trap.mstatus = ((trap.mstatus & MSTATUS_MPIE) ? MSTATUS_MIE : 0) | MSTATUS_MPIE | MSTATUS_MPP;
+    hart.pc_next = trap.mepc;
+    hart.next_event = 0; // interrupts may be enabled again
 }
 
-void RISCV32::base_I32::sub(uint32_t rd, uint32_t rs1, uint32_t rs2) {
-    if (debug_mode == 1) {
-        print_inst(pc, "sub " + std::to_string(rd) + ", " + std::to_string(rs1) + ", " + std::to_string(rs2));
+template <class Cfg>
+void RISCV32::Machine32::wfi(RISCV32& hart, const Decoded32&) {
+    hart.waiting = true;
+    hart.next_event = 0;
+}
+
+// Device events
+bool RISCV32::timer_pending() {
+    uint64_t cmp;
+    memory.read_mem_u64<false>(CLINT_MTIMECMP + 8 * hartid, &cmp);
+    return clock() / CLINT_TICK >= cmp;
+}
+
+// The mtime refresh is always queued; the timer event is set at the next look at mtimecmp
+void RISCV32::reset_events() {
+    events = std::priority_queue<Event32, std::vector<Event32>, std::greater<Event32> >();
+    events.push(Event32 { (clock() / CLINT_TICK + 1) * CLINT_TICK, EVENT_MTIME });
+    timer_cmp = UINT64_MAX;
+    waiting = false;
+    next_event = 0;
+}
+
+// Runs at the first block boundary past next_event: refreshes mtime, follows mtimecmp and takes the timer interrupt.
+// mtimecmp is only read here, so a write to it takes effect within a tick, or at once when followed by a csr write or mret.
+void RISCV32::service_events() {
+    uint64_t cmp;
+    memory.read_mem_u64<false>(CLINT_MTIMECMP + 8 * hartid, &cmp);
+    uint64_t deadline = (cmp <= UINT64_MAX / CLINT_TICK) ? cmp * CLINT_TICK : UINT64_MAX;
+    if (cmp != timer_cmp) {
+        timer_cmp = cmp;
+        if (deadline != UINT64_MAX && deadline > clock()) events.push(Event32 { deadline, EVENT_TIMER });
+    }
+    if (waiting) {
+        // Nothing to take yet: the clock skips to the timer instead of spinning; without one wfi is a nop
+        waiting = false;
+        if ((trap.mie & MIP_MTIP) && deadline != UINT64_MAX && deadline > clock()) idle += deadline - clock();
+    }
+
+    uint64_t now = clock();
+    while (events.top().when <= now) {
+        Event32 event = events.top();
+        events.pop();
+        if (event.kind == EVENT_MTIME) events.push(Event32 { (now / CLINT_TICK + 1) * CLINT_TICK, EVENT_MTIME });
+        // A timer event only brings the hart here, mtimecmp decides below
     }
-    if (rd != 0) reg32[rd] = reg32[rs1] - reg32[rs2];
+    memory.write_device_u64(CLINT_MTIME, now / CLINT_TICK);
+    if ((trap.mstatus & MSTATUS_MIE) && (trap.mie & MIP_MTIP) && now / CLINT_TICK >= cmp) {
+        enter_trap(true, IRQ_M_TIMER, 0);
+    }
+    next_event = events.top().when - idle;
+}
+
+// RV32M and RV64M; the *W forms use the same rules at 32 bits
+template <class S>
+static inline S div_signed(S a, S b) {
+    if (b == 0) return -1;
+    if (b == -1 && a == std::numeric_limits<S>::min()) return a; // overflow
+    return a / b;
+}
+
+template <class S>
+static inline S rem_signed(S a, S b) {
+    if (b == 0) return a;
+    if (b == -1 && a == std::numeric_limits<S>::min()) return 0; // overflow
+    return a % b;
+}
+
+template <class Cfg>
+void RISCV32::ext_M32::mul(RISCV32& hart, const Decoded32& inst) {
+    hart.write_x<Cfg>(inst.rd, hart.read_x<Cfg>(inst.rs1) * hart.read_x<Cfg>(inst.rs2));
+}
+
+template <class Cfg>
+void RISCV32::ext_M32::mulh(RISCV32& hart, const Decoded32& inst) {
+    typename Cfg::swide product = (typename Cfg::swide)hart.read_sx<Cfg>(inst.rs1) * hart.read_sx<Cfg>(inst.rs2);
+    hart.write_x<Cfg>(inst.rd, (typename Cfg::uwide)product >> Cfg::xlen);
+}
+
+template <class Cfg>
+void RISCV32::ext_M32::mulhsu(RISCV32& hart, const Decoded32& inst) {
+    // fits, rs2 is below 2^XLEN
+    typename Cfg::swide product = (typename Cfg::swide)hart.read_sx<Cfg>(inst.rs1) * (typename Cfg::swide)hart.read_x<Cfg>(inst.rs2);
+    hart.write_x<Cfg>(inst.rd, (typename Cfg::uwide)product >> Cfg::xlen);
+}
+
+template <class Cfg>
+void RISCV32::ext_M32::mulhu(RISCV32& hart, const Decoded32& inst) {
+    typename Cfg::uwide product = (typename Cfg::uwide)hart.read_x<Cfg>(inst.rs1) * hart.read_x<Cfg>(inst.rs2);
+    hart.write_x<Cfg>(inst.rd, product >> Cfg::xlen);
 }
 
-void RISCV32::base_I32::sll(uint32_t rd, uint32_t rs1, uint32_t rs2) {
-    if (debug_mode == 1) {
-        print_inst(pc, "sll " + std::to_string(rd) + ", " + std::to_string(rs1) + ", " + std::to_string(rs2));
+template <class Cfg>
+void RISCV32::ext_M32::div(RISCV32& hart, const Decoded32& inst) {
+    hart.write_x<Cfg>(inst.rd, div_signed(hart.read_sx<Cfg>(inst.rs1), hart.read_sx<Cfg>(inst.rs2)));
+}
+
+template <class Cfg>
+void RISCV32::ext_M32::divu(RISCV32& hart, const Decoded32& inst) {
+    typename Cfg::uxlen a = hart.read_x<Cfg>(inst.rs1), b = hart.read_x<Cfg>(inst.rs2);
+    hart.write_x<Cfg>(inst.rd, (b == 0) ? ~(typename Cfg::uxlen)0 : a / b);
+}
+
+template <class Cfg>
+void RISCV32::ext_M32::rem(RISCV32& hart, const Decoded32& inst) {
+    hart.write_x<Cfg>(inst.rd, rem_signed(hart.read_sx<Cfg>(inst.rs1), hart.read_sx<Cfg>(inst.rs2)));
+}
+
+template <class Cfg>
+void RISCV32::ext_M32::remu(RISCV32& hart, const Decoded32& inst) {
+    typename Cfg::uxlen a = hart.read_x<Cfg>(inst.rs1), b = hart.read_x<Cfg>(inst.rs2);
+    hart.write_x<Cfg>(inst.rd, (b == 0) ? a : a % b);
+}
+
+template <class Cfg>
+void RISCV32::ext_M64::mulw(RISCV32& hart, const Decoded32& inst) {
+    hart.write_w<Cfg>(inst.rd, (uint32_t)hart.read_x<Cfg>(inst.rs1) * (uint32_t)hart.read_x<Cfg>(inst.rs2));
+}
+
+template <class Cfg>
+void RISCV32::ext_M64::divw(RISCV32& hart, const Decoded32& inst) {
+    hart.write_w<Cfg>(inst.rd, div_signed((int32_t)hart.read_x<Cfg>(inst.rs1), (int32_t)hart.read_x<Cfg>(inst.rs2)));
+}
+
+template <class Cfg>
+void RISCV32::ext_M64::divuw(RISCV32& hart, const Decoded32& inst) {
+    uint32_t a = hart.read_x<Cfg>(inst.rs1), b = hart.read_x<Cfg>(inst.rs2);
+    hart.write_w<Cfg>(inst.rd, (b == 0) ? 0xFFFFFFFF : a / b);
+}
+
+template <class Cfg>
+void RISCV32::ext_M64::remw(RISCV32& hart, const Decoded32& inst) {
+    hart.write_w<Cfg>(inst.rd, rem_signed((int32_t)hart.read_x<Cfg>(inst.rs1), (int32_t)hart.read_x<Cfg>(inst.rs2)));
+}
+
+template <class Cfg>
+void RISCV32::ext_M64::remuw(RISCV32& hart, const Decoded32& inst) {
+    uint32_t a = hart.read_x<Cfg>(inst.rs1), b = hart.read_x<Cfg>(inst.rs2);
+    hart.write_w<Cfg>(inst.rd, (b == 0) ? a : a % b);
+}
+
+// RV32A; every host atomic is sequentially consistent, which covers any aq and rl bits.
+// RV64 sign-extends the loaded words
+template <class Cfg>
+void RISCV32::ext_A32::lr_w(RISCV32& hart, const Decoded32& inst) {
+    uint32_t addr = guest_addr<Cfg>(hart.read_x<Cfg>(inst.rs1));
+    uint32_t value = hart.memory.load_atomic_u32(addr);
+    hart.reservation_valid = true;
+    hart.reservation_addr = addr;
+    hart.reservation_value = value;
+    hart.write_w<Cfg>(inst.rd, value);
+}
+
+template <class Cfg>
+void RISCV32::ext_A32::sc_w(RISCV32& hart, const Decoded32& inst) {
+    uint32_t addr = guest_addr<Cfg>(hart.read_x<Cfg>(inst.rs1));
+    bool stored = hart.reservation_valid && hart.reservation_addr == addr
+        && hart.memory.compare_swap_u32(addr, hart.reservation_value, hart.read_x<Cfg>(inst.rs2));
+    hart.reservation_valid = false;
+    hart.write_x<Cfg>(inst.rd, stored ? 0 : 1);
+}
+
+template <class Cfg>
+void RISCV32::ext_A32::amo_w(RISCV32& hart, const Decoded32& inst) {
+    uint32_t old = hart.memory.amo_u32(guest_addr<Cfg>(hart.read_x<Cfg>(inst.rs1)), inst.op, hart.read_x<Cfg>(inst.rs2));
+    hart.write_w<Cfg>(inst.rd, old);
+}
+
+// RV32F
+// Host exception flags are sticky, so arithmetic leaves them to accumulate and they are folded in here
+void RISCV32::sync_fflags() {
+    int raised = std::fetestexcept(FE_ALL_EXCEPT);
+    if (raised == 0) return;
+    if (raised & FE_INEXACT) fflags |= FFLAG_NX;
+    if (raised & FE_UNDERFLOW) fflags |= FFLAG_UF;
+    if (raised & FE_OVERFLOW) fflags |= FFLAG_OF;
+    if (raised & FE_DIVBYZERO) fflags |= FFLAG_DZ;
+    if (raised & FE_INVALID) fflags |= FFLAG_NV;
+    std::feclearexcept(FE_ALL_EXCEPT);
+}
+
+float RISCV32::ext_F32::get(RISCV32& hart, uint8_t reg) {
+    float value;
+    std::memcpy(&value, &hart.freg32[reg], 4);
+    return value;
+}
+
+// Arithmetic results; every NaN becomes the canonical one
+void RISCV32::ext_F32::set(RISCV32& hart, uint8_t reg, float value) {
+    if (value != value) {
+        hart.freg32[reg] = F32_CANONICAL_NAN;
+        return;
     }
-    if (rd != 0) reg32[rd] = reg32[rs1] << (reg32[rs2] & 0x1F); // Only lower 5-bits matters.
+    std::memcpy(&hart.freg32[reg], &value, 4);
+}
+
+uint8_t RISCV32::ext_F32::rounding(RISCV32& hart, const Decoded32& inst) {
+    uint8_t rm = (inst.rm == FRM_DYN) ? hart.frm : inst.rm;
+    if (rm > FRM_RMM) INSTR_ERR;
+    return rm;
+}
+
+static inline bool f32_is_snan(uint32_t bits) {
+    return (bits & 0x7FC00000) == 0x7F800000 && (bits & 0x003FFFFF) != 0;
+}
+
+// Runs op in rm; round to nearest even is the host default, the other modes switch the host mode around it.
+// RMM has no host mode and starts from the nearest-even result, see f32_rmm
+template <class Op>
+static inline float f32_round(uint8_t rm, Op op) {
+    if (rm == FRM_RNE || rm == FRM_RMM) return op();
+    std::fesetround(rm == FRM_RTZ ? FE_TOWARDZERO : rm == FRM_RDN ? FE_DOWNWARD : FE_UPWARD);
+    float result = op();
+    std::fesetround(FE_TONEAREST);
+    return result;
+}
+
+// Turns the nearest-even result r of the exact value x + e into the RMM one: they differ only on an exact tie
+// with the neighbour away from zero. Quotients and square roots are never ties and need no call
+static float f32_rmm(float r, double x, double e) {
+    if (e != 0) return r; // a tie is a midpoint of two floats, which a double holds exactly
+    uint32_t bits;
+    std::memcpy(&bits, &r, 4);
+    bits++;
+    float n;
+    std::memcpy(&n, &bits, 4);
+    // Past FLT_MAX the neighbour is the overflow threshold 2^128, and rounding to it overflows
+    double away = std::isinf(n) ? std::copysign(std::ldexp(1.0, 128), (double)r) : n;
+    if (x != ((double)r + away) / 2) return r;
+    if (std::isinf(n)) std::feraiseexcept(FE_OVERFLOW | FE_INEXACT);
+    return n;
+}
+
+// Exact sum of two doubles as x + e
+static inline void two_sum(double a, double b, double* x, double* e) {
+    *x = a + b;
+    double bb = *x - a;
+    *e = (a - (*x - bb)) + (b - bb);
+}
+
+template <class Cfg>
+void RISCV32::ext_F32::flw(RISCV32& hart, const Decoded32& inst) {
+    uint32_t data;
+    hart.memory.read_mem_u32<Cfg::align>(hart.effective_addr<Cfg>(inst), &data);
+    hart.freg32[inst.rd] = data;
+}
+
+template <class Cfg>
+void RISCV32::ext_F32::fsw(RISCV32& hart, const Decoded32& inst) {
+    hart.memory.write_mem_u32<Cfg::align>(hart.effective_addr<Cfg>(inst), hart.freg32[inst.rs2]);
 }
 
-void RISCV32::base_I32::slt(uint32_t rd, uint32_t rs1, uint32_t rs2) {
-    if (debug_mode == 1) {
-        print_inst(pc, "slt " + std::to_string(rd) + ", " + std::to_string(rs1) + ", " + std::to_string(rs2));
+// One rounding of rs1 * rs2 + rs3, with the product and the addend negated as the opcode says
+template <class Cfg>
+void RISCV32::ext_F32::fmadd_s(RISCV32& hart, const Decoded32& inst) {
+    float a = get(hart, inst.rs1), b = get(hart, inst.rs2), c = get(hart, inst.rs3);
+    if (inst.op == OP_FNMSUB_S || inst.op == OP_FNMADD_S) a = -a;
+    if (inst.op == OP_FMSUB_S || inst.op == OP_FNMADD_S) c = -c;
+    uint8_t rm = rounding(hart, inst);
+    float r = f32_round(rm, [&] { return std::fma(a, b, c); });
+    if (rm == FRM_RMM && std::isfinite(r)) {
+        double x, e;
+        two_sum((double)a * b, c, &x, &e); // the product is exact in double
+        r = f32_rmm(r, x, e);
     }
-    if (rd != 0) reg32[rd] = (int32_t)reg32[rs1] < (int32_t)reg32[rs2] ? 1 : 0;
+    set(hart, inst.rd, r);
 }
 
-void RISCV32::base_I32::sltu(uint32_t rd, uint32_t rs1, uint32_t rs2) {
-    if (debug_mode == 1) {
-        print_inst(pc, "sltu " + std::to_string(rd) + ", " + std::to_string(rs1) + ", " + std::to_string(rs2));
+template <class Cfg>
+void RISCV32::ext_F32::fadd_s(RISCV32& hart, const Decoded32& inst) {
+    float a = get(hart, inst.rs1), b = get(hart, inst.rs2);
+    uint8_t rm = rounding(hart, inst);
+    float r = f32_round(rm, [&] { return a + b; });
+    if (rm == FRM_RMM && std::isfinite(r)) {
+        double x, e;
+        two_sum(a, b, &x, &e);
+        r = f32_rmm(r, x, e);
     }
-    if (rd != 0) reg32[rd] = reg32[rs1] < reg32[rs2] ? 1 : 0;
+    set(hart, inst.rd, r);
 }
 
-void RISCV32::base_I32::xor_(uint32_t rd, uint32_t rs1, uint32_t rs2) {
-    if (debug_mode == 1) {
-        print_inst(pc, "xor " + std::to_string(rd) + ", " + std::to_string(rs1) + ", " + std::to_string(rs2));
+template <class Cfg>
+void RISCV32::ext_F32::fsub_s(RISCV32& hart, const Decoded32& inst) {
+    float a = get(hart, inst.rs1), b = get(hart, inst.rs2);
+    uint8_t rm = rounding(hart, inst);
+    float r = f32_round(rm, [&] { return a - b; });
+    if (rm == FRM_RMM && std::isfinite(r)) {
+        double x, e;
+        two_sum(a, -(double)b, &x, &e);
+        r = f32_rmm(r, x, e);
     }
-    if (rd != 0) reg32[rd] = reg32[rs1] ^ reg32[rs2];
+    set(hart, inst.rd, r);
+}
+
+template <class Cfg>
+void RISCV32::ext_F32::fmul_s(RISCV32& hart, const Decoded32& inst) {
+    float a = get(hart, inst.rs1), b = get(hart, inst.rs2);
+    uint8_t rm = rounding(hart, inst);
+    float r = f32_round(rm, [&] { return a * b; });
+    if (rm == FRM_RMM && std::isfinite(r)) r = f32_rmm(r, (double)a * b, 0);
+    set(hart, inst.rd, r);
+}
+
+template <class Cfg>
+void RISCV32::ext_F32::fdiv_s(RISCV32& hart, const Decoded32& inst) {
+    float a = get(hart, inst.rs1), b = get(hart, inst.rs2);
+    set(hart, inst.rd, f32_round(rounding(hart, inst), [&] { return a / b; }));
+}
+
+template <class Cfg>
+void RISCV32::ext_F32::fsqrt_s(RISCV32& hart, const Decoded32& inst) {
+    float a = get(hart, inst.rs1);
+    set(hart, inst.rd, f32_round(rounding(hart, inst), [&] { return std::sqrt(a); }));
+}
+
+// Sign injection works on the bits, NaNs included
+template <class Cfg>
+void RISCV32::ext_F32::fsgnj_s(RISCV32& hart, const Decoded32& inst) {
+    uint32_t a = hart.freg32[inst.rs1], b = hart.freg32[inst.rs2];
+    uint32_t sign = (inst.op == OP_FSGNJ_S) ? b : (inst.op == OP_FSGNJN_S) ? ~b : a ^ b;
+    hart.freg32[inst.rd] = (a & 0x7FFFFFFF) | (sign & 0x80000000);
+}
+
+// A single NaN operand yields the other one, -0 orders below +0
+template <class Cfg>
+void RISCV32::ext_F32::fmin_s(RISCV32& hart, const Decoded32& inst) {
+    uint32_t a_bits = hart.freg32[inst.rs1], b_bits = hart.freg32[inst.rs2];
+    float a = get(hart, inst.rs1), b = get(hart, inst.rs2);
+    bool min = inst.op == OP_FMIN_S;
+    if (f32_is_snan(a_bits) || f32_is_snan(b_bits)) hart.fflags |= FFLAG_NV;
+    uint32_t result;
+    if (a != a && b != b) result = F32_CANONICAL_NAN;
+    else if (a != a) result = b_bits;
+    else if (b != b) result = a_bits;
+    else if (a == b) result = min ? (a_bits | b_bits) : (a_bits & b_bits); // differ only in the sign of zeros
+    else result = ((a < b) == min) ? a_bits : b_bits;
+    hart.freg32[inst.rd] = result;
 }
 
-void RISCV32::base_I32::srl(uint32_t rd, uint32_t rs1, uint32_t rs2) {
-    if (debug_mode == 1) {
-        print_inst(pc, "srl " + std::to_string(rd) + ", " + std::to_string(rs1) + ", " + std::to_string(rs2));
+// Integer rounding in rm, exact in double; libm may raise inexact here, the caller decides on it
+static double f32_round_int(float value, uint8_t rm) {
+    double d = value, result;
+    std::fexcept_t inexact;
+    std::fegetexceptflag(&inexact, FE_INEXACT);
+    switch (rm) {
+        case FRM_RTZ: result = std::trunc(d); break;
+        case FRM_RDN: result = std::floor(d); break;
+        case FRM_RUP: result = std::ceil(d); break;
+        case FRM_RMM: result = std::round(d); break;
+        default: result = std::nearbyint(d); break;
     }
-    if (rd != 0) reg32[rd] = reg32[rs1] >> (reg32[rs2] & 0x1F); // Only lower 5-bits matters.
+    std::fesetexceptflag(&inexact, FE_INEXACT);
+    return result;
 }
 
-void RISCV32::base_I32::sra(uint32_t rd, uint32_t rs1, uint32_t rs2) {
-    if (debug_mode == 1) {
-        print_inst(pc, "sra " + std::to_string(rd) + ", " + std::to_string(rs1) + ", " + std::to_string(rs2));
+// Out of range values and NaN saturate and raise invalid
+template <class Cfg>
+void RISCV32::ext_F32::fcvt_w_s(RISCV32& hart, const Decoded32& inst) {
+    float a = get(hart, inst.rs1);
+    uint8_t rm = rounding(hart, inst);
+    uint32_t result;
+    if (a != a) {
+        result = 0x7FFFFFFF;
+        hart.fflags |= FFLAG_NV;
+    } else {
+        double r = f32_round_int(a, rm);
+        if (r < -2147483648.0) {
+            result = 0x80000000;
+            hart.fflags |= FFLAG_NV;
+        } else if (r > 2147483647.0) {
+            result = 0x7FFFFFFF;
+            hart.fflags |= FFLAG_NV;
+        } else {
+            result = (uint32_t)(int32_t)r;
+            if (r != a) hart.fflags |= FFLAG_NX;
+        }
     }
-    if (rd != 0) reg32[rd] = (int32_t)reg32[rs1] >> (reg32[rs2] & 0x1F); // Only lower 5-bits matters.
+    hart.write_w<Cfg>(inst.rd, result);
 }
 
-void RISCV32::base_I32::or_(uint32_t rd, uint32_t rs1, uint32_t rs2) {
-    if (debug_mode == 1) {
-        print_inst(pc, "or " + std::to_string(rd) + ", " + std::to_string(rs1) + ", " + std::to_string(rs2));
+template <class Cfg>
+void RISCV32::ext_F32::fcvt_wu_s(RISCV32& hart, const Decoded32& inst) {
+    float a = get(hart, inst.rs1);
+    uint8_t rm = rounding(hart, inst);
+    uint32_t result;
+    if (a != a) {
+        result = 0xFFFFFFFF;
+        hart.fflags |= FFLAG_NV;
+    } else {
+        double r = f32_round_int(a, rm);
+        if (r < 0) {
+            result = 0;
+            hart.fflags |= FFLAG_NV;
+        } else if (r > 4294967295.0) {
+            result = 0xFFFFFFFF;
+            hart.fflags |= FFLAG_NV;
+        } else {
+            result = (uint32_t)r;
+            if (r != a) hart.fflags |= FFLAG_NX;
+        }
     }
-    if (rd != 0) reg32[rd] = reg32[rs1] | reg32[rs2];
+    hart.write_w<Cfg>(inst.rd, result);
 }
 
-void RISCV32::base_I32::and_(uint32_t rd, uint32_t rs1, uint32_t rs2) {
-    if (debug_mode == 1) {
-        print_inst(pc, "and " + std::to_string(rd) + ", " + std::to_string(rs1) + ", " + std::to_string(rs2));
+template <class Cfg>
+void RISCV32::ext_F32::fmv_x_w(RISCV32& hart, const Decoded32& inst) {
+    hart.write_w<Cfg>(inst.rd, hart.freg32[inst.rs1]);
+}
+
+// feq is quiet and only signaling NaNs raise invalid, flt and fle raise it for any NaN
+template <class Cfg>
+void RISCV32::ext_F32::fcmp_s(RISCV32& hart, const Decoded32& inst) {
+    uint32_t a_bits = hart.freg32[inst.rs1], b_bits = hart.freg32[inst.rs2];
+    float a = get(hart, inst.rs1), b = get(hart, inst.rs2);
+    uint32_t result = 0;
+    if (a != a || b != b) {
+        if (inst.op != OP_FEQ_S || f32_is_snan(a_bits) || f32_is_snan(b_bits)) hart.fflags |= FFLAG_NV;
+    } else {
+        result = (inst.op == OP_FEQ_S) ? a == b : (inst.op == OP_FLT_S) ? a < b : a <= b;
     }
-    if (rd != 0) reg32[rd] = reg32[rs1] & reg32[rs2];
+    hart.write_w<Cfg>(inst.rd, result);
+}
+
+template <class Cfg>
+void RISCV32::ext_F32::fclass_s(RISCV32& hart, const Decoded32& inst) {
+    uint32_t bits = hart.freg32[inst.rs1];
+    bool negative = bits >> 31;
+    uint32_t exponent = (bits >> 23) & 0xFF, fraction = bits & 0x7FFFFF;
+    int bit;
+    if (exponent == 0xFF) bit = (fraction == 0) ? (negative ? 0 : 7) : (fraction & 0x400000) ? 9 : 8;
+    else if (exponent == 0) bit = (fraction == 0) ? (negative ? 3 : 4) : (negative ? 2 : 5);
+    else bit = negative ? 1 : 6;
+    hart.write_x<Cfg>(inst.rd, 1u << bit);
+}
+
+template <class Cfg>
+void RISCV32::ext_F32::fcvt_s_w(RISCV32& hart, const Decoded32& inst) {
+    int32_t a = (int32_t)hart.read_x<Cfg>(inst.rs1);
+    uint8_t rm = rounding(hart, inst);
+    float r = f32_round(rm, [&] { return (float)a; });
+    if (rm == FRM_RMM && std::isfinite(r)) r = f32_rmm(r, a, 0);
+    set(hart, inst.rd, r);
+}
+
+template <class Cfg>
+void RISCV32::ext_F32::fcvt_s_wu(RISCV32& hart, const Decoded32& inst) {
+    uint32_t a = hart.read_x<Cfg>(inst.rs1);
+    uint8_t rm = rounding(hart, inst);
+    float r = f32_round(rm, [&] { return (float)a; });
+    if (rm == FRM_RMM && std::isfinite(r)) r = f32_rmm(r, a, 0);
+    set(hart, inst.rd, r);
+}
+
+template <class Cfg>
+void RISCV32::ext_F32::fmv_w_x(RISCV32& hart, const Decoded32& inst) {
+    hart.freg32[inst.rd] = hart.read_x<Cfg>(inst.rs1);
 }
@@ -1,141 +1,764 @@
+#include <atomic>
+#include <csetjmp>
 #include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
 
-#define MEM_SIZE 0x10000
-#define INSTR_ERR throw std::runtime_error("Invalid instruction")
-#define MEM_ALIGN_ERR throw std::runtime_error("Unaligned memory access")
-#define MEM_OUT_ERR throw std::runtime_error("Memory out of bounds")
+#define MEM_SIZE 0x100000000ULL // the whole 32-bit space, committed on demand
+#define MEM_GUARD_SIZE 0x10000 // inaccessible bytes past the top, catch wrapping accesses
+#define MEM_DUMP_SIZE 0x10000 // bytes printed by print_mem_all
+#define MEM_PAGE_SHIFT 12 // granularity of dirty tracking and snapshots
+#define MEM_DIRTY_BYTES (MEM_SIZE >> MEM_PAGE_SHIFT) // one byte per page
+#define MEM_DIRTY_GROUP_SHIFT 6 // one summary byte per 64 pages
+#define MEM_DIRTY_GROUP_BYTES (MEM_DIRTY_BYTES >> MEM_DIRTY_GROUP_SHIFT)
+#define MEM_CODE_BYTES (MEM_SIZE >> MEM_PAGE_SHIFT) // one byte per page, a bit per hart with code on it
+#define HART_STACK_SIZE 0x100000 // each further hart's stack starts this far below the previous one
+#define DECODE_CACHE_SIZE 0x1000 // entries per hart, direct-mapped by pc
+#define BLOCK_MAX_INSTS 64
+#define JIT_THRESHOLD 16 // block executions before translating to host code
+#define JIT_CODE_SIZE 0x1000000
+#define JIT_BLOCK_MAX_CODE 0x2000
+#define TRACE_RING_SIZE 0x10000 // records buffered per hart
+#define TRACE_MAGIC_RV32 "RV32TRC2" // 8 bytes at the start of a binary trace
+#define TRACE_MAGIC_RV64 "RV64TRC2"
+#define PROFILE_INTERVAL 997 // instructions between samples, prime so loops do not alias
+#define PROFILE_MAX_DEPTH 256 // calls tracked for folded stacks
+#define PROFILE_REPORT_LINES 20
+#define SYSCALL_CONSOLE_BUFFER 0x1000 // guest stdout bytes collected before a host write
+// Zicntr counters, the emulator's own counters are hpmcounter3..7
+#define CSR_CYCLE 0xC00
+#define CSR_TIME 0xC01 // CLINT mtime, the hart clock in CLINT_TICK units
+#define CSR_INSTRET 0xC02
+#define CSR_LOADS 0xC03
+#define CSR_STORES 0xC04
+#define CSR_TAKEN_BRANCHES 0xC05
+#define CSR_DECODE_MISSES 0xC06
+#define CSR_FUSED_PAIRS 0xC07 // instruction pairs executed as one operation
+#define CSR_HIGH 0x80 // offset of the upper half of a counter
+#define CSR_MHARTID 0xF14
+// Machine-mode trap CSRs
+#define CSR_MSTATUS 0x300
+#define CSR_MIE 0x304
+#define CSR_MTVEC 0x305
+#define CSR_MSCRATCH 0x340
+#define CSR_MEPC 0x341
+#define CSR_MCAUSE 0x342
+#define CSR_MTVAL 0x343
+#define CSR_MIP 0x344
+#define MSTATUS_MIE 0x8
+#define MSTATUS_MPIE 0x80
+#define MSTATUS_MPP 0x1800 // previous mode, always M as the only one
+#define MIP_MTIP 0x80
+#define IRQ_M_TIMER 7
+// CLINT registers in guest memory; the clock of a hart is its retired instructions plus the ones skipped by wfi
+#define CLINT_MTIMECMP 0x02004000 // 8 bytes per hart
+#define CLINT_MTIME 0x0200BFF8
+#define CLINT_TICK 1000 // clock per mtime tick, mtime is refreshed once per tick
+#define CSR_FFLAGS 0x001
+#define CSR_FRM 0x002
+#define CSR_FCSR 0x003
+// Rounding modes, 7 in an instruction selects frm
+#define FRM_RNE 0
+#define FRM_RTZ 1
+#define FRM_RDN 2
+#define FRM_RUP 3
+#define FRM_RMM 4
+#define FRM_DYN 7
+// fflags
+#define FFLAG_NX 0x01
+#define FFLAG_UF 0x02
+#define FFLAG_OF 0x04
+#define FFLAG_DZ 0x08
+#define FFLAG_NV 0x10
+#define F32_CANONICAL_NAN 0x7FC00000
+// Exception causes
+#define CAUSE_MISALIGNED_FETCH 0
+#define CAUSE_FETCH_ACCESS 1
+#define CAUSE_ILLEGAL_INSTRUCTION 2
+#define CAUSE_MISALIGNED_LOAD 4
+#define CAUSE_LOAD_ACCESS 5
+#define CAUSE_MISALIGNED_STORE 6 // and AMO
+#define CAUSE_STORE_ACCESS 7
+// Guest faults, taken as traps while a hart runs and thrown as std::runtime_error otherwise
+#define INSTR_ERR fault(FAULT_ILLEGAL, 0)
+#define MEM_ALIGN_ERR(addr) fault(FAULT_MISALIGNED, addr)
+#define MEM_OUT_ERR(addr) fault(FAULT_ACCESS, addr)
+#define JUMP_ALIGN_ERR(addr) fault(FAULT_MISALIGNED_JUMP, addr)
 
 class RISCV32 {
+    public:
+        // Execution core configuration, fixed at compile time
+        template <bool Debug, bool Align, unsigned Xlen>
+        struct Config {
+            static const bool debug = Debug; // trace every instruction
+            static const bool align = Align; // disallow unaligned access
+            static const unsigned xlen = Xlen; // register width, 32 or 64
+            typedef typename std::conditional<Xlen == 64, uint64_t, uint32_t>::type uxlen;
+            typedef typename std::conditional<Xlen == 64, int64_t, int32_t>::type sxlen;
+            typedef typename std::conditional<Xlen == 64, unsigned __int128, uint64_t>::type uwide; // holds a full product
+            typedef typename std::conditional<Xlen == 64, __int128, int64_t>::type swide;
+        };
+        template <bool Debug, bool Align> using Config32 = Config<Debug, Align, 32>;
+        template <bool Debug, bool Align> using Config64 = Config<Debug, Align, 64>;
+
+        // Kinds of guest faults
+        enum Fault32 : uint8_t { FAULT_ILLEGAL, FAULT_MISALIGNED, FAULT_ACCESS, FAULT_MISALIGNED_JUMP };
+
     private:
-        // 0 for allowing unaligned access, 1 for disallowing
-        static int mem_access_align;
-        
-        // 0 for disallowing debug mode, 1 for allowing
-        static int debug_mode;
+        // 0 for interpreting only, 1 for translating hot blocks to host code
+        int jit_mode;
+
+        // Optional extensions, instructions of disabled ones decode as illegal
+        struct Extensions32 {
+            bool M;
+            bool A;
+            bool F;
+            bool C;
+        };
+        Extensions32 ext;
+
+        // Harts of one machine share memory, each runs on its own host thread
+        uint32_t hartid;
+
+        // 32 for RV32I, 64 for RV64I; run() takes the core of the same width
+        unsigned xlen;
         
         // Status
         bool running;
 
         // program counter
-        static uint32_t pc;
-        static uint32_t pc_next;
+        uint32_t pc;
+        uint32_t pc_next;
+
+        // x registers; RV32 keeps them zero-extended, so translated code works on the low halves
+        uint64_t xreg[32] /* = {0, } */;
+        void print_reg_all();  
+
+        // RV32F registers as raw bits; without D, FLEN is 32 and values are not NaN-boxed
+        uint32_t freg32[32];
+        uint8_t frm;
+        uint8_t fflags; // host exception flags are folded in when read, see sync_fflags
+
+        // Retired instructions, counted per block
+        uint64_t instret;
+
+        // Emulator counters, counted per block except for decode misses
+        struct Counters32 {
+            uint64_t loads;
+            uint64_t stores;
+            uint64_t taken_branches;
+            uint64_t decode_misses;
+            uint64_t fused_pairs;
+        };
+        Counters32 counters;
+
+        // run() returns when pc reaches this block boundary, 0xFFFFFFFF for none
+        uint32_t stop_pc;
+
+        // Decoded operations
+        enum Op32 : uint8_t {
+            OP_HALT, OP_ILLEGAL, OP_UNKNOWN,
+            OP_LUI, OP_AUIPC, OP_JAL, OP_JALR,
+            OP_BEQ, OP_BNE, OP_BLT, OP_BGE, OP_BLTU, OP_BGEU,
+            OP_LB, OP_LH, OP_LW, OP_LBU, OP_LHU, OP_SB, OP_SH, OP_SW,
+            OP_ADDI, OP_SLTI, OP_SLTIU, OP_XORI, OP_ORI, OP_ANDI, OP_SLLI, OP_SRLI, OP_SRAI,
+            OP_ADD, OP_SUB, OP_SLL, OP_SLT, OP_SLTU, OP_XOR, OP_SRL, OP_SRA, OP_OR, OP_AND,
+            OP_CSRRW, OP_CSRRS, OP_CSRRC, OP_CSRRWI, OP_CSRRSI, OP_CSRRCI,
+            OP_MUL, OP_MULH, OP_MULHSU, OP_MULHU, OP_DIV, OP_DIVU, OP_REM, OP_REMU,
+            OP_FENCE,
+            OP_LR_W, OP_SC_W, OP_AMOSWAP_W, OP_AMOADD_W, OP_AMOXOR_W, OP_AMOAND_W, OP_AMOOR_W,
+            OP_AMOMIN_W, OP_AMOMAX_W, OP_AMOMINU_W, OP_AMOMAXU_W,
+            OP_FLW, OP_FSW, OP_FMADD_S, OP_FMSUB_S, OP_FNMSUB_S, OP_FNMADD_S,
+            OP_FADD_S, OP_FSUB_S, OP_FMUL_S, OP_FDIV_S, OP_FSQRT_S,
+            OP_FSGNJ_S, OP_FSGNJN_S, OP_FSGNJX_S, OP_FMIN_S, OP_FMAX_S,
+            OP_FCVT_W_S, OP_FCVT_WU_S, OP_FMV_X_W, OP_FEQ_S, OP_FLT_S, OP_FLE_S, OP_FCLASS_S,
+            OP_FCVT_S_W, OP_FCVT_S_WU, OP_FMV_W_X,
+            // RV64 only
+            OP_LWU, OP_LD, OP_SD,
+            OP_ADDIW, OP_SLLIW, OP_SRLIW, OP_SRAIW, OP_ADDW, OP_SUBW, OP_SLLW, OP_SRLW, OP_SRAW,
+            OP_MULW, OP_DIVW, OP_DIVUW, OP_REMW, OP_REMUW,
+            // Fused slt/sltu and beqz/bnez on the result, only built by translate_block
+            OP_SLT_BEQ, OP_SLT_BNE, OP_SLTU_BEQ, OP_SLTU_BNE,
+            OP_ECALL, OP_MRET, OP_WFI, OP_FENCE_I
+        };
+
+        // Pre-decoded instruction, built once per pc
+        struct Decoded32;
+        typedef void (*Handler32)(RISCV32& hart, const Decoded32& inst);
+        struct Decoded32 {
+            Handler32 handler;      // nullptr for the terminating noop
+            uint32_t pc;
+            uint32_t imm;
+            uint8_t op;
+            uint8_t rd;
+            uint8_t rs1;
+            uint8_t rs2;
+            uint8_t rs3;            // fused multiply-add
+            uint8_t rm;             // rounding mode of floating-point instructions
+            uint8_t len;            // 2 for instructions expanded from RVC, else 4
+            uint8_t count;          // instructions retired, 2 for a fused pair
+        };
+        std::vector<Decoded32> decode_cache;
+
+        // x registers at the width of the core
+        template <class Cfg> typename Cfg::uxlen read_x(uint8_t reg) const;
+        template <class Cfg> typename Cfg::sxlen read_sx(uint8_t reg) const;
+        template <class Cfg> void write_x(uint8_t reg, typename Cfg::uxlen value);
+        template <class Cfg> void write_w(uint8_t reg, uint32_t value); // sign-extends 32-bit results
+        // Immediates sign-extend to XLEN
+        template <class Cfg> static typename Cfg::uxlen imm_x(const Decoded32& inst);
+        // Guest memory is the low 4 GiB, RV64 addresses above it are out of bounds
+        template <class Cfg> static uint32_t guest_addr(typename Cfg::uxlen addr);
+        template <class Cfg> uint32_t effective_addr(const Decoded32& inst) const;
+
+        static void decode32(uint32_t instr, Decoded32* inst);
+        // RVC: the 32-bit instruction a 16-bit one stands for, false for reserved encodings
+        static bool expand16(uint16_t parcel, unsigned xlen, uint32_t* instr);
+        // 32-bit form of the instruction at addr; parcel is the 16-bit one it came from, 0 if none
+        template <class Cfg> bool fetch_instr(uint32_t addr, uint32_t* instr, uint16_t* parcel);
+        template <class Cfg> static Handler32 handler_of(uint8_t op);
+        template <class Cfg> const Decoded32& fetch_decoded(uint32_t addr);
+
+        // Host code for a block: returns the number of instructions it completed
+        typedef uint32_t (*JitCode32)(uint64_t* reg, uint8_t* mem, uint32_t* pc_next);
+
+        // Straight-line run of decoded instructions ending at a branch or jump
+        struct Block32 {
+            std::vector<Decoded32> insts;
+            uint32_t end_pc;        // pc after the last instruction
+            bool halt;              // ends at the terminating noop
+            uint32_t succ_pc[2];    // chained successors, 0xFFFFFFFF if unused
+            Block32* succ[2];
+            uint32_t exec_count;
+            JitCode32 jit_code;     // nullptr until translated
+            uint16_t loads;         // counted once per execution
+            uint16_t stores;
+            bool cond_branch;       // ends at a conditional branch
+            uint8_t link;           // ends at a call or a return, for the profiler
+            uint16_t retired;       // instructions retired per execution
+            uint16_t fused;         // fused pairs among them
+            std::vector<uint16_t> jit_starts; // host code offset of each translated record, then of the exit
+            int8_t jit_host[32];    // host register each guest register lives in, -1 if in xreg[]
+            uint32_t fetch_end;     // end of the instructions decoded for it, including the one that ended it
+            bool stale;             // its code was written, translated again on the next lookup
+        };
+        enum Link32 : uint8_t { LINK_NONE, LINK_CALL, LINK_RETURN };
+        std::unordered_map<uint32_t, Block32> block_cache;
 
-        static uint32_t reg32[32] /* = {0, } */;
-        static void print_reg_all();  
-        void execute32(uint32_t instr);
+        // Stores over decoded code drop the affected decode cache entries and blocks; the pages
+        // holding code are marked in guest memory, so other stores only pay for one map lookup
+        std::unordered_map<uint32_t, std::vector<uint32_t> > code_pages; // page -> blocks with code on it
+        uint64_t code_stores_seen; // stores by other harts over code, as of the last fence.i
+        void add_code(const Block32& block, uint32_t addr);
+        void invalidate_code(uint32_t addr, uint32_t size);
+        void flush_code();
+        void unlink_stale();
+
+        static bool ends_block(const Decoded32& inst);
+        template <class Cfg> static bool fuse(Decoded32* first, const Decoded32& second);
+        static bool is_csr(const Decoded32& inst);
+        static bool writes_freg(uint8_t op);
+        template <class Cfg> Block32* translate_block(uint32_t addr);
+        template <class Cfg> Block32* lookup_block(uint32_t addr);
+        template <class Cfg> Block32* chain_block(Block32* block);
+        template <class Cfg> void execute32(uint32_t instr);
+        static void illegal(RISCV32& hart, const Decoded32& inst);
+        static void unknown(RISCV32& hart, const Decoded32& inst);
         
+        // x86-64 translation of hot blocks, the decoded records stay the fallback
+        class JIT32 {
+            private:
+                uint8_t* code_buf;
+                size_t code_used;
+
+            public:
+                JIT32();
+                ~JIT32();
+                void compile(RISCV32& hart, Block32* block, bool align);
+                uint32_t enter(RISCV32& hart, const Block32* block);
+                void flush(RISCV32& hart);
+                // Record of block a fault at host_pc belongs to, nullptr if none; the guest registers
+                // held in host_regs (by host register number) go back to xreg[]
+                const Decoded32* locate_fault(RISCV32& hart, const Block32* block, const uint64_t* host_regs, uint64_t host_pc);
+        };
+        JIT32 jit;
+
+        // Guest faults jump back to the run loop through fault() and trap at the faulting record;
+        // until mtvec is set, the run stops with an error instead
+        [[noreturn]] static void fault(uint8_t kind, uint64_t tval);
+        Block32* current;            // block being run
+        const Decoded32* executing;  // record being interpreted, nullptr while in host code
+        template <class Cfg> bool take_fault(const Decoded32& inst);
+
+        // Without C every instruction is 4-byte aligned, a jump anywhere else faults on the jump itself
+        void jump_to(uint32_t target) {
+            if (!ext.C && (target & 2)) JUMP_ALIGN_ERR(target);
+            pc_next = target;
+        }
+
+        // Execution trace, handed to a writer thread through a ring buffer
+        class Trace32 {
+            public:
+                // Binary trace record, stored as is after the magic
+                struct Record {
+                    uint32_t pc;
+                    uint32_t instr;     // raw instruction word
+                    uint32_t mem_addr;  // effective address of loads and stores
+                    uint32_t parcel;    // RVC instruction instr was expanded from, zero for 32-bit ones
+                    uint64_t rd_value;  // rd after write-back
+                    uint64_t mem_value; // value stored, or loaded into rd
+                };
+
+            private:
+                std::vector<Record> ring;
+                std::atomic<uint64_t> head;  // next record the writer takes
+                std::atomic<uint64_t> tail;  // next record the hart fills
+                uint64_t head_seen;          // the hart's last look at head
+                std::atomic<bool> done;
+                std::thread writer;
+                std::string path;            // binary trace file, empty for text on stdout
+                FILE* file;
+                unsigned xlen;
+
+                void write_out();
+
+            public:
+                Trace32();
+                ~Trace32();
+                Trace32(const Trace32&) = delete;
+                Trace32& operator=(const Trace32&) = delete;
+
+                void set_file(const std::string& trace_file);
+                void start(unsigned xlen);
+                void stop();
+                void push(const Record& rec);
+
+                static std::string disasm(uint32_t instr);
+                static void print(const Record& rec, bool values, unsigned xlen);
+        };
+        Trace32 trace;
+        template <class Cfg> void execute_traced(const Decoded32& inst);
+
+        // Function symbols of an ELF program, sorted by address
+        struct Symbol32 {
+            uint32_t addr;
+            uint32_t size;
+            std::string name;
+        };
+        std::vector<Symbol32> symbols;
+
+        // Sampling profiler, fed at block boundaries
+        class Profile32 {
+            private:
+                const std::vector<Symbol32>& symbols;
+                uint64_t samples;
+                std::unordered_map<uint32_t, uint64_t> pc_samples;
+                std::unordered_map<uint32_t, uint64_t> block_samples;
+                std::map<std::vector<uint32_t>, uint64_t> stack_samples; // call sites, then the sampled pc
+                std::vector<uint32_t> calls; // shadow call stack
+                uint32_t dropped_calls;      // calls past PROFILE_MAX_DEPTH
+
+                const Symbol32* lookup(uint32_t pc) const;
+                std::string symbolize(uint32_t pc, bool offset) const;
+
+            public:
+                Profile32(const std::vector<Symbol32>& symbols);
+                void sample(uint32_t pc, uint32_t block_pc);
+                void call(uint32_t call_pc);
+                void ret();
+                void report();
+                void write_folded(const std::string& path);
+        };
+        Profile32 profile;
+        bool profiling;
+        uint64_t next_sample; // instret of the next sample, never reached when not profiling
+        void profile_block(const Block32* block);
+        void profile_samples(const Block32* block, uint64_t retired);
+
+        class Syscall32;
+
         class Memory32 {
+            friend class JIT32;
+            friend class Syscall32;
+
             private:
-                static uint8_t mem[MEM_SIZE] /* = {0, } */;
+                uint8_t* mem /* = {0, } */;
+                uint8_t* dirty; // pages written since the last save or restore
+                uint8_t* dirty_groups; // groups of pages with a dirty one, so clean memory is skipped fast
+                uint8_t* code; // pages some hart has decoded code on, a bit per hart
+                bool owner; // unmaps the reservation, false for the memory of further harts
+                RISCV32* hart; // whose decoded code stores through this memory invalidate
+                uint8_t code_bit; // of that hart; harts past the seventh share the last bit, which stays set
+                std::shared_ptr<std::atomic<uint64_t> > foreign_code_stores; // stores over the code of another hart
+
+                static void install_fault_handler();
+                void mark_dirty(uint32_t addr);
+                void mark_dirty_range(uint32_t addr, size_t size);
+                void code_written(uint32_t addr, size_t size);
+                void map_file(int fd, uint32_t offset, uint32_t addr, uint32_t size, bool writable);
+                template <class Elf> void load_elf(int fd, const uint8_t* file, size_t size, uint32_t* entry, uint32_t* end, std::vector<Symbol32>* symbols);
             
             public:
-                static void read_mem_u8(uint32_t addr, uint8_t* data);
-                static void read_mem_u16(uint32_t addr, uint16_t* data);
-                static void read_mem_u32(uint32_t addr, uint32_t* data);
-                static void write_mem_u8(uint32_t addr, uint8_t data);
-                static void write_mem_u16(uint32_t addr, uint16_t data);
-                static void write_mem_u32(uint32_t addr, uint32_t data);
+                Memory32();
+                explicit Memory32(Memory32* shared);
+                ~Memory32();
+                Memory32(const Memory32&) = delete;
+                Memory32& operator=(const Memory32&) = delete;
+
+                // Code of the given hart
+                void attach_code(RISCV32* hart, uint32_t hartid);
+                void mark_code(uint32_t page);
+                void clear_code(uint32_t page);
+                uint64_t code_stores_elsewhere() const;
+
+                // While alive, faults on this memory jump back to the given point instead of a bounds check
+                class FaultScope {
+                    public:
+                        FaultScope(Memory32& memory, sigjmp_buf* jmp);
+                        ~FaultScope();
+                };
+
+                template <bool Align> void read_mem_u8(uint32_t addr, uint8_t* data);
+                template <bool Align> void read_mem_u16(uint32_t addr, uint16_t* data);
+                template <bool Align> void read_mem_u32(uint32_t addr, uint32_t* data);
+                template <bool Align> void read_mem_u64(uint32_t addr, uint64_t* data);
+                template <bool Align> void write_mem_u8(uint32_t addr, uint8_t data);
+                template <bool Align> void write_mem_u16(uint32_t addr, uint16_t data);
+                template <bool Align> void write_mem_u32(uint32_t addr, uint32_t data);
+                template <bool Align> void write_mem_u64(uint32_t addr, uint64_t data);
+                void read_block(uint32_t addr, void* data, size_t size);
+                void write_block(uint32_t addr, const void* data, size_t size);
+                // Device registers the emulator updates, not counted as written by the guest
+                void write_device_u64(uint32_t addr, uint64_t data);
+                void fill(uint32_t addr, uint8_t value, size_t size);
+
+                // Host atomics on aligned guest words, sequentially consistent
+                uint32_t load_atomic_u32(uint32_t addr);
+                bool compare_swap_u32(uint32_t addr, uint32_t expected, uint32_t desired);
+                uint32_t amo_u32(uint32_t addr, uint8_t op, uint32_t value);
+                void dirty_pages(std::vector<uint32_t>* pages, bool clear);
+
+                // Pages that may differ from zero, kept in a memory file and mapped back copy-on-write
+                struct Snapshot {
+                    int fd;
+                    std::vector<uint32_t> pages; // ascending, page i of the file holds pages[i]
+                    Snapshot() : fd(-1) {}
+                    ~Snapshot();
+                    Snapshot(const Snapshot&) = delete;
+                    Snapshot& operator=(const Snapshot&) = delete;
+                };
+                void save(Snapshot* snap);
+                void restore(const Snapshot& snap);
                
-                static void read_program(const char* program_file);
+                // Flat binaries load at 0; returns true with the entry point, XLEN and symbols for ELF files
+                // end is the top of the loaded image, where the guest heap starts
+                bool read_program(const char* program_file, uint32_t* entry, unsigned* xlen, uint32_t* end, std::vector<Symbol32>* symbols);
 
-                static void print_mem_all();
-                static void print_mem_u8(uint32_t addr);
-                static void print_mem_u16(uint32_t addr);
-                static void print_mem_u32(uint32_t addr);
+                void print_mem_all();
+                void print_pages(const std::vector<uint32_t>& pages);
+                void write_image(const std::string& path, const std::vector<uint32_t>& pages, bool hex);
+                void print_mem_u8(uint32_t addr);
+                void print_mem_u16(uint32_t addr);
+                void print_mem_u32(uint32_t addr);
         };
+        Memory32 memory;
         static uint32_t imm_gen(uint32_t instr);
 
+        // Newlib system calls on ecall, served by the host straight from guest memory; one per machine
+        class Syscall32 {
+            private:
+                std::mutex lock;           // everything below, the harts of a machine share it
+                std::vector<int> fds;      // guest fd -> host fd, -1 if closed
+                uint32_t heap_start;
+                uint32_t heap_end;         // program break
+                std::vector<char> console; // pending guest stdout
+                bool console_tty;          // line-buffered instead of buffered
+
+                int host_fd(uint64_t fd);
+                bool write_console(Memory32& memory, uint32_t addr, uint32_t size);
+                int64_t copy_out(Memory32& memory, uint64_t addr, const void* data, size_t size);
+                void flush_console();
+
+            public:
+                std::atomic<bool> exited;  // the program called exit, every hart stops
+                int exit_code;
+
+                explicit Syscall32(uint32_t image_end);
+                ~Syscall32();
+                Syscall32(const Syscall32&) = delete;
+                Syscall32& operator=(const Syscall32&) = delete;
+
+                // a7 selects the call, a0..a5 hold the arguments; returns a0, -errno on failure
+                int64_t call(RISCV32& hart, uint64_t num, const uint64_t* args);
+                void flush();
+
+                // Program break and exit status, kept with the snapshot of a hart; open files are not
+                struct State {
+                    uint32_t heap_end;
+                    bool exited;
+                    int exit_code;
+                };
+                void save(State* state);
+                void restore(const State& state);
+
+                template <class Cfg> static void ecall(RISCV32& hart, const Decoded32& inst);
+        };
+        std::shared_ptr<Syscall32> sys;
+
+        // Machine-mode trap state, at the width of the hart
+        struct Trap32 {
+            uint64_t mstatus;
+            uint64_t mie;
+            uint64_t mtvec;
+            uint64_t mscratch;
+            uint64_t mepc;
+            uint64_t mcause;
+            uint64_t mtval;
+        };
+        Trap32 trap;
+        // Enters the handler at mtvec, returning to pc; only taken at block boundaries
+        void enter_trap(bool interrupt, uint32_t code, uint64_t tval);
+
+        // Device events, earliest first by clock; the run loop looks at them once next_event passes
+        enum EventKind32 : uint8_t { EVENT_MTIME, EVENT_TIMER };
+        struct Event32 {
+            uint64_t when;
+            uint8_t kind;
+            bool operator>(const Event32& other) const { return when > other.when; }
+        };
+        std::priority_queue<Event32, std::vector<Event32>, std::greater<Event32> > events;
+        uint64_t next_event; // instret of the earliest event, 0 to look at the next block boundary
+        uint64_t idle;       // clock skipped by wfi
+        uint64_t timer_cmp;  // mtimecmp the timer event was set for, UINT64_MAX for none
+        bool waiting;        // in wfi
+        uint64_t clock() const { return instret + idle; }
+        bool timer_pending();
+        void reset_events();
+        void service_events();
+
+        struct Snapshot32 {
+            bool valid;
+            uint32_t pc;
+            uint64_t xreg[32];
+            uint32_t freg32[32];
+            uint8_t frm;
+            uint8_t fflags;
+            uint64_t instret;
+            uint64_t idle;
+            Trap32 trap;
+            Counters32 counters;
+            Syscall32::State sys;
+            Memory32::Snapshot memory;
+        };
+        Snapshot32 snapshot;
+        void modified_pages(std::vector<uint32_t>* pages);
+
         // Instructions
         class base_I32 {
             public:
                 // Instructions
                 // U-type 
-                static void lui(uint32_t rd, uint32_t imm);
-                static void auipc(uint32_t rd, uint32_t imm);
+                template <class Cfg> static void lui(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void auipc(RISCV32& hart, const Decoded32& inst);
                 
                 // J-type
-                static void jal(uint32_t rd, uint32_t imm);
+                template <class Cfg> static void jal(RISCV32& hart, const Decoded32& inst);
                 
                 // I-type
-                static void jalr(uint32_t rd, uint32_t rs1, uint32_t imm);
+                template <class Cfg> static void jalr(RISCV32& hart, const Decoded32& inst);
 
                 // B-type
-                static void beq(uint32_t rs1, uint32_t rs2, uint32_t imm);
-                static void bne(uint32_t rs1, uint32_t rs2, uint32_t imm);
-                static void blt(uint32_t rs1, uint32_t rs2, uint32_t imm);
-                static void bge(uint32_t rs1, uint32_t rs2, uint32_t imm);
-                static void bltu(uint32_t rs1, uint32_t rs2, uint32_t imm);
-                static void bgeu(uint32_t rs1, uint32_t rs2, uint32_t imm);
+                template <class Cfg> static void beq(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void bne(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void blt(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void bge(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void bltu(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void bgeu(RISCV32& hart, const Decoded32& inst);
 
                 // I-type
-                static void lb(uint32_t rd, uint32_t rs1, uint32_t imm);
-                static void lh(uint32_t rd, uint32_t rs1, uint32_t imm);
-                static void lw(uint32_t rd, uint32_t rs1, uint32_t imm);
-                static void lbu(uint32_t rd, uint32_t rs1, uint32_t imm);
-                static void lhu(uint32_t rd, uint32_t rs1, uint32_t imm);
+                template <class Cfg> static void lb(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void lh(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void lw(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void lbu(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void lhu(RISCV32& hart, const Decoded32& inst);
                 
                 // S-type
-                static void sb(uint32_t rs1, uint32_t rs2, uint32_t imm);
-                static void sh(uint32_t rs1, uint32_t rs2, uint32_t imm);
-                static void sw(uint32_t rs1, uint32_t rs2, uint32_t imm);
+                template <class Cfg> static void sb(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void sh(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void sw(RISCV32& hart, const Decoded32& inst);
                 
                 // I-type
-                static void addi(uint32_t rd, uint32_t rs1, uint32_t imm);
-                static void slti(uint32_t rd, uint32_t rs1, uint32_t imm);
-                static void sltiu(uint32_t rd, uint32_t rs1, uint32_t imm);
-                static void xori(uint32_t rd, uint32_t rs1, uint32_t imm);
-                static void ori(uint32_t rd, uint32_t rs1, uint32_t imm);
-                static void andi(uint32_t rd, uint32_t rs1, uint32_t imm);
-                static void slli(uint32_t rd, uint32_t rs1, uint32_t shamt);
-                static void srli(uint32_t rd, uint32_t rs1, uint32_t shamt);
-                static void srai(uint32_t rd, uint32_t rs1, uint32_t shamt);
+                template <class Cfg> static void addi(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void slti(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void sltiu(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void xori(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void ori(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void andi(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void slli(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void srli(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void srai(RISCV32& hart, const Decoded32& inst);
 
                 // R-type
-                static void add(uint32_t rd, uint32_t rs1, uint32_t rs2);
-                static void sub(uint32_t rd, uint32_t rs1, uint32_t rs2);
-                static void sll(uint32_t rd, uint32_t rs1, uint32_t rs2);
-                static void slt(uint32_t rd, uint32_t rs1, uint32_t rs2);
-                static void sltu(uint32_t rd, uint32_t rs1, uint32_t rs2);
-                static void xor_(uint32_t rd, uint32_t rs1, uint32_t rs2);
-                static void srl(uint32_t rd, uint32_t rs1, uint32_t rs2);
-                static void sra(uint32_t rd, uint32_t rs1, uint32_t rs2);
-                static void or_(uint32_t rd, uint32_t rs1, uint32_t rs2);
-                static void and_(uint32_t rd, uint32_t rs1, uint32_t rs2);
-        };
-        /*
-        class ext_M32 {
-            private:
-                // 0 for not extended, 1 for extended
-                static bool extended;
+                template <class Cfg> static void add(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void sub(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void sll(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void slt(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void sltu(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void xor_(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void srl(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void sra(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void or_(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void and_(RISCV32& hart, const Decoded32& inst);
 
+                // Memory ordering, a full host fence for other harts
+                template <class Cfg> static void fence(RISCV32& hart, const Decoded32& inst);
+                // Later fetches see every store; stores of other harts over this hart's code take effect here
+                template <class Cfg> static void fence_i(RISCV32& hart, const Decoded32& inst);
+                // Fused pair: rd = slt/sltu, then branch on rd
+                template <class Cfg> static void slt_branch(RISCV32& hart, const Decoded32& inst);
+        };
+        // RV64I additions: doubleword memory access and the *W operations on the low 32 bits
+        class base_I64 {
             public:
-                static void extend(bool ext);
+                template <class Cfg> static void lwu(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void ld(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void sd(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void addiw(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void slliw(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void srliw(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void sraiw(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void addw(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void subw(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void sllw(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void srlw(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void sraw(RISCV32& hart, const Decoded32& inst);
         };
+        // Zicsr, CSR instructions run alone in their block so counters are exact
+        uint64_t read_csr(uint32_t csr);
+        void write_csr(uint32_t csr, uint64_t value);
+        class Zicsr32 {
+            public:
+                template <class Cfg> static void csrrw(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void csrrs(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void csrrc(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void csrrwi(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void csrrsi(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void csrrci(RISCV32& hart, const Decoded32& inst);
+        };
+        // Privileged instructions of machine mode, ending their block so the interrupt check follows
+        class Machine32 {
+            public:
+                template <class Cfg> static void mret(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void wfi(RISCV32& hart, const Decoded32& inst);
+        };
+        // RV32M, division by zero and overflow give the results the spec defines instead of trapping
+        class ext_M32 {
+            public:
+                template <class Cfg> static void mul(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void mulh(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void mulhsu(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void mulhu(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void div(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void divu(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void rem(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void remu(RISCV32& hart, const Decoded32& inst);
+        };
+        class ext_M64 {
+            public:
+                template <class Cfg> static void mulw(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void divw(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void divuw(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void remw(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void remuw(RISCV32& hart, const Decoded32& inst);
+        };
+        // RV32A; sc succeeds while the reserved word still holds the value lr read
+        bool reservation_valid;
+        uint32_t reservation_addr;
+        uint32_t reservation_value;
         class ext_A32 {
-            private:
-                // 0 for not extended, 1 for extended
-                static bool extended;
-            
             public:
-                static void extend(bool ext);
+                template <class Cfg> static void lr_w(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void sc_w(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void amo_w(RISCV32& hart, const Decoded32& inst);
         };
+        void init_hart(uint32_t id, uint32_t entry);
+        // RV32F on host single precision; only non-default rounding modes switch the host mode
+        void sync_fflags();
         class ext_F32 {
             private:
-                // 0 for not extended, 1 for extended
-                static bool extended;
-            
+                static float get(RISCV32& hart, uint8_t reg);
+                static void set(RISCV32& hart, uint8_t reg, float value);
+                static uint8_t rounding(RISCV32& hart, const Decoded32& inst);
+
             public:
-                static void extend(bool ext);
+                template <class Cfg> static void flw(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void fsw(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void fmadd_s(RISCV32& hart, const Decoded32& inst); // and fmsub, fnmsub, fnmadd
+                template <class Cfg> static void fadd_s(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void fsub_s(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void fmul_s(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void fdiv_s(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void fsqrt_s(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void fsgnj_s(RISCV32& hart, const Decoded32& inst); // and fsgnjn, fsgnjx
+                template <class Cfg> static void fmin_s(RISCV32& hart, const Decoded32& inst); // and fmax
+                template <class Cfg> static void fcvt_w_s(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void fcvt_wu_s(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void fmv_x_w(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void fcmp_s(RISCV32& hart, const Decoded32& inst); // feq, flt, fle
+                template <class Cfg> static void fclass_s(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void fcvt_s_w(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void fcvt_s_wu(RISCV32& hart, const Decoded32& inst);
+                template <class Cfg> static void fmv_w_x(RISCV32& hart, const Decoded32& inst);
         };
-        */
 
     public:
+        // xlen applies to flat binaries, ELF files bring their own
         RISCV32(
-            bool mem_access, bool debug, bool M, bool A, bool F,
+            bool jit, bool M, bool A, bool F, bool C, unsigned xlen,
             const char* program_file, uint32_t mem_start, uint32_t entrypoint
         );
-        void run();
+        // A further hart of the same machine, starting at the entry point of boot
+        RISCV32(RISCV32* boot, uint32_t id);
+        RISCV32(const RISCV32&) = delete;
+        RISCV32& operator=(const RISCV32&) = delete;
+        template <class Cfg> void run();
         static void print_inst(uint32_t pc, std::string msg);
+        static void print_trace(const char* trace_file, bool values);
+
+        // Traced runs write a binary trace here instead of text on stdout
+        void set_trace_file(const std::string& trace_file) { trace.set_file(trace_file); }
+        void print_mem_all() { memory.print_mem_all(); }
+        // Only the pages the program occupies or wrote
+        void print_mem_modified();
+        void write_mem_image(const std::string& path, bool hex);
+
+        // Set before the first run; the machine can be captured there and reset to it later
+        void set_stop_pc(uint32_t addr) { stop_pc = addr; }
+        void save_snapshot();
+        void restore_snapshot();
+
+        unsigned get_xlen() const { return xlen; }
+        uint32_t get_pc() const { return pc; }
+        uint64_t get_reg(int i) const { return xreg[i]; }
+        uint64_t get_instret() const { return instret; }
+        // Status the program passed to exit, 0 if it ended otherwise
+        bool exited() const { return sys->exited; }
+        int get_exit_code() const { return sys->exited ? sys->exit_code : 0; }
+        uint64_t get_counter(uint32_t csr);
+        void print_counters();
+
+        // Sample the pc every PROFILE_INTERVAL instructions from the next run on
+        void enable_profile();
+        void print_profile() { profile.report(); }
+        void write_folded_stacks(const std::string& path) { profile.write_folded(path); }
 };
 
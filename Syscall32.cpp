@@ -0,0 +1,242 @@
+#include "RISCV32.h"
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// System call numbers libgloss passes in a7
+#define SYS_OPENAT 56
+#define SYS_CLOSE 57
+#define SYS_LSEEK 62
+#define SYS_READ 63
+#define SYS_WRITE 64
+#define SYS_FSTAT 80
+#define SYS_EXIT 93
+#define SYS_EXIT_GROUP 94
+#define SYS_GETTIMEOFDAY 169
+#define SYS_BRK 214
+#define SYS_OPEN 1024
+
+// Newlib open flags, the access mode bits match the host's
+#define NEWLIB_O_ACCMODE 0x3
+#define NEWLIB_O_APPEND 0x0008
+#define NEWLIB_O_CREAT 0x0200
+#define NEWLIB_O_TRUNC 0x0400
+#define NEWLIB_O_EXCL 0x0800
+#define NEWLIB_AT_FDCWD -100
+
+#define GUEST_STAT_SIZE 128 // struct kernel_stat of libgloss
+
+// The heap starts on a page of its own, the last one of the image may be read-only
+RISCV32::Syscall32::Syscall32(uint32_t image_end) : exited(false), exit_code(0) {
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t start = ((uint64_t)image_end + page - 1) & ~(page - 1);
+    heap_start = heap_end = (start > UINT32_MAX) ? UINT32_MAX : start;
+    for (int fd = 0; fd < 3; fd++) fds.push_back(fd);
+    console.reserve(SYSCALL_CONSOLE_BUFFER);
+    console_tty = isatty(1);
+}
+
+RISCV32::Syscall32::~Syscall32() {
+    flush_console();
+    for (size_t fd = 3; fd < fds.size(); fd++) {
+        if (fds[fd] >= 0) close(fds[fd]);
+    }
+}
+
+void RISCV32::Syscall32::flush() {
+    std::lock_guard<std::mutex> guard(lock);
+    flush_console();
+}
+
+void RISCV32::Syscall32::save(State* state) {
+    std::lock_guard<std::mutex> guard(lock);
+    state->heap_end = heap_end;
+    state->exited = exited.load();
+    state->exit_code = exit_code;
+}
+
+// Output of the run being undone has been written already
+void RISCV32::Syscall32::restore(const State& state) {
+    std::lock_guard<std::mutex> guard(lock);
+    flush_console();
+    heap_end = state.heap_end;
+    exit_code = state.exit_code;
+    exited.store(state.exited);
+}
+
+int RISCV32::Syscall32::host_fd(uint64_t fd) {
+    return (fd < fds.size()) ? fds[fd] : -1;
+}
+
+// Guest buffers are used in place, they only have to lie inside guest memory
+static bool in_guest(uint64_t addr, uint64_t size) {
+    return addr <= MEM_SIZE && size <= MEM_SIZE - addr;
+}
+
+static bool write_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+void RISCV32::Syscall32::flush_console() {
+    if (console.empty()) return;
+    write_all(1, console.data(), console.size());
+    console.clear();
+}
+
+// Small writes are collected, large ones go to the host straight from guest memory
+bool RISCV32::Syscall32::write_console(Memory32& memory, uint32_t addr, uint32_t size) {
+    const char* data = (const char*)memory.mem + addr;
+    if (console.size() + size > SYSCALL_CONSOLE_BUFFER) flush_console();
+    if (size >= SYSCALL_CONSOLE_BUFFER) return write_all(1, data, size);
+    console.insert(console.end(), data, data + size);
+    if (console_tty && std::memchr(data, '\n', size) != nullptr) flush_console();
+    return true;
+}
+
+// Results are stored through the kernel, as read() stores its data: a read-only guest page
+// fails the call with EFAULT instead of faulting out of it with the lock held
+int64_t RISCV32::Syscall32::copy_out(Memory32& memory, uint64_t addr, const void* data, size_t size) {
+    struct iovec local = { const_cast<void*>(data), size };
+    struct iovec remote = { memory.mem + addr, size };
+    ssize_t n = process_vm_writev(getpid(), &local, 1, &remote, 1, 0);
+    if (n > 0) memory.mark_dirty_range(addr, n);
+    if (n < 0) return -errno;
+    return ((size_t)n == size) ? 0 : -EFAULT;
+}
+
+static void put_u64(uint8_t* buf, uint64_t value) {
+    for (int i = 0; i < 8; i++) buf[i] = value >> (8 * i);
+}
+
+int64_t RISCV32::Syscall32::call(RISCV32& hart, uint64_t num, const uint64_t* args) {
+    std::lock_guard<std::mutex> guard(lock);
+    Memory32& memory = hart.memory;
+    // Signed arguments of RV32 only fill the low half
+    auto sarg = [&](int i) { return hart.xlen == 32 ? (int64_t)(int32_t)args[i] : (int64_t)args[i]; };
+
+    switch (num) {
+        case SYS_READ: {
+            int fd = host_fd(args[0]);
+            if (fd < 0) return -EBADF;
+            if (!in_guest(args[1], args[2])) return -EFAULT;
+            if (fd == 0) flush_console(); // prompts show before the program waits for input
+            ssize_t n = read(fd, memory.mem + args[1], args[2]);
+            if (n < 0) return -errno;
+            memory.mark_dirty_range(args[1], n);
+            return n;
+        }
+        case SYS_WRITE: {
+            int fd = host_fd(args[0]);
+            if (fd < 0) return -EBADF;
+            if (!in_guest(args[1], args[2])) return -EFAULT;
+            if (fd == 1) return write_console(memory, args[1], args[2]) ? (int64_t)args[2] : -EIO;
+            if (fd == 2) flush_console(); // keeps the order of stdout and stderr
+            ssize_t n = write(fd, memory.mem + args[1], args[2]);
+            return (n < 0) ? -errno : n;
+        }
+        case SYS_OPEN:
+        case SYS_OPENAT: {
+            int at = AT_FDCWD;
+            const uint64_t* open_args = args;
+            if (num == SYS_OPENAT) {
+                if (sarg(0) != NEWLIB_AT_FDCWD) {
+                    at = host_fd(args[0]);
+                    if (at < 0) return -EBADF;
+                }
+                open_args = args + 1;
+            }
+            uint64_t path = open_args[0];
+            if (path >= MEM_SIZE) return -EFAULT;
+            if (std::memchr(memory.mem + path, 0, MEM_SIZE - path) == nullptr) return -EFAULT;
+            uint64_t guest_flags = open_args[1];
+            int flags = guest_flags & NEWLIB_O_ACCMODE;
+            if (guest_flags & NEWLIB_O_APPEND) flags |= O_APPEND;
+            if (guest_flags & NEWLIB_O_CREAT) flags |= O_CREAT;
+            if (guest_flags & NEWLIB_O_TRUNC) flags |= O_TRUNC;
+            if (guest_flags & NEWLIB_O_EXCL) flags |= O_EXCL;
+            int fd = openat(at, (const char*)memory.mem + path, flags | O_CLOEXEC, (mode_t)open_args[2]);
+            if (fd < 0) return -errno;
+            // Lowest free guest fd, as the host would pick
+            size_t guest_fd = 0;
+            while (guest_fd < fds.size() && fds[guest_fd] >= 0) guest_fd++;
+            if (guest_fd == fds.size()) fds.push_back(fd);
+            else fds[guest_fd] = fd;
+            return guest_fd;
+        }
+        case SYS_CLOSE: {
+            int fd = host_fd(args[0]);
+            if (fd < 0) return -EBADF;
+            if (args[0] == 1) flush_console();
+            fds[args[0]] = -1;
+            if (fd > 2) close(fd); // the emulator keeps its own standard streams
+            return 0;
+        }
+        case SYS_LSEEK: {
+            int fd = host_fd(args[0]);
+            if (fd < 0) return -EBADF;
+            off_t offset = lseek(fd, sarg(1), (int)args[2]);
+            return (offset < 0) ? -errno : offset;
+        }
+        case SYS_FSTAT: {
+            int fd = host_fd(args[0]);
+            if (fd < 0) return -EBADF;
+            if (!in_guest(args[1], GUEST_STAT_SIZE)) return -EFAULT;
+            struct stat st;
+            if (fstat(fd, &st) != 0) return -errno;
+            uint8_t buf[GUEST_STAT_SIZE] = {0, };
+            put_u64(buf + 0, st.st_dev);
+            put_u64(buf + 8, st.st_ino);
+            put_u64(buf + 16, st.st_mode | ((uint64_t)st.st_nlink << 32));
+            put_u64(buf + 24, st.st_uid | ((uint64_t)st.st_gid << 32));
+            put_u64(buf + 32, st.st_rdev);
+            put_u64(buf + 48, st.st_size);
+            put_u64(buf + 56, st.st_blksize);
+            put_u64(buf + 64, st.st_blocks);
+            put_u64(buf + 72, st.st_atim.tv_sec);
+            put_u64(buf + 80, st.st_atim.tv_nsec);
+            put_u64(buf + 88, st.st_mtim.tv_sec);
+            put_u64(buf + 96, st.st_mtim.tv_nsec);
+            put_u64(buf + 104, st.st_ctim.tv_sec);
+            put_u64(buf + 112, st.st_ctim.tv_nsec);
+            return copy_out(memory, args[1], buf, sizeof(buf));
+        }
+        case SYS_GETTIMEOFDAY: {
+            if (args[0] == 0) return 0;
+            if (!in_guest(args[0], 16)) return -EFAULT;
+            struct timeval tv;
+            gettimeofday(&tv, nullptr);
+            // 64-bit tv_sec, then tv_usec as a long padded to 8 bytes
+            uint8_t buf[16];
+            put_u64(buf, tv.tv_sec);
+            put_u64(buf + 8, tv.tv_usec);
+            return copy_out(memory, args[0], buf, sizeof(buf));
+        }
+        case SYS_BRK: {
+            // The heap grows from the end of the image and must stay below the caller's stack
+            if (args[0] >= heap_start && args[0] < hart.xreg[2]) heap_end = args[0];
+            return heap_end;
+        }
+        case SYS_EXIT:
+        case SYS_EXIT_GROUP: {
+            flush_console();
+            exit_code = (int)args[0];
+            exited.store(true);
+            return 0;
+        }
+        default: {
+            return -ENOSYS;
+        }
+    }
+}
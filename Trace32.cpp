@@ -0,0 +1,249 @@
+#include "RISCV32.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+RISCV32::Trace32::Trace32() : ring(TRACE_RING_SIZE), head(0), tail(0), head_seen(0), done(false), file(nullptr), xlen(32) {
+}
+
+RISCV32::Trace32::~Trace32() {
+    stop();
+    if (file != nullptr) fclose(file);
+}
+
+void RISCV32::Trace32::set_file(const std::string& trace_file) {
+    path = trace_file;
+}
+
+void RISCV32::Trace32::start(unsigned xlen) {
+    if (writer.joinable()) return;
+    this->xlen = xlen;
+    if (!path.empty() && file == nullptr) {
+        file = fopen(path.c_str(), "wb");
+        if (file == nullptr) {
+            throw std::runtime_error("Failed to open trace file.");
+        }
+        fwrite(xlen == 64 ? TRACE_MAGIC_RV64 : TRACE_MAGIC_RV32, 1, 8, file);
+    }
+    done.store(false);
+    writer = std::thread(&Trace32::write_out, this);
+}
+
+void RISCV32::Trace32::stop() {
+    if (!writer.joinable()) return;
+    done.store(true);
+    writer.join();
+    if (file != nullptr) fflush(file);
+    else std::cout.flush();
+}
+
+void RISCV32::Trace32::push(const Record& rec) {
+    uint64_t t = tail.load(std::memory_order_relaxed);
+    // Only look at the writer's progress again when the ring seems full
+    while (t - head_seen == TRACE_RING_SIZE) {
+        head_seen = head.load(std::memory_order_acquire);
+        if (t - head_seen == TRACE_RING_SIZE) std::this_thread::yield();
+    }
+    ring[t & (TRACE_RING_SIZE - 1)] = rec;
+    tail.store(t + 1, std::memory_order_release);
+}
+
+// Writer thread: drains the ring in contiguous chunks until stopped and empty
+void RISCV32::Trace32::write_out() {
+    uint64_t h = head.load(std::memory_order_relaxed);
+    while (true) {
+        bool stopping = done.load(std::memory_order_acquire);
+        uint64_t t = tail.load(std::memory_order_acquire);
+        if (h == t) {
+            if (stopping) break;
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+            continue;
+        }
+        while (h != t) {
+            size_t at = h & (TRACE_RING_SIZE - 1);
+            size_t count = std::min<uint64_t>(t - h, TRACE_RING_SIZE - at);
+            if (file != nullptr) {
+                fwrite(&ring[at], sizeof(Record), count, file);
+            } else {
+                for (size_t i = 0; i < count; i++) print(ring[at + i], false, xlen);
+            }
+            h += count;
+            head.store(h, std::memory_order_release);
+        }
+    }
+}
+
+// Same text as the interpreter always printed, empty for words it does not trace
+std::string RISCV32::Trace32::disasm(uint32_t instr) {
+    Decoded32 inst;
+    decode32(instr, &inst);
+    std::string rd = std::to_string(inst.rd), rs1 = std::to_string(inst.rs1), rs2 = std::to_string(inst.rs2), rs3 = std::to_string(inst.rs3);
+    std::string imm = std::to_string(inst.imm), simm = std::to_string((int32_t)inst.imm);
+    switch (inst.op) {
+        case OP_LUI: return "lui " + rd + ", " + imm;
+        case OP_AUIPC: return "auipc " + rd + ", " + simm;
+        case OP_JAL: return "jal " + rd + ", " + simm;
+        case OP_JALR: return "jalr " + rd + ", " + rs1 + ", " + simm;
+        case OP_BEQ: return "beq " + rs1 + ", " + rs2 + ", " + simm;
+        case OP_BNE: return "bne " + rs1 + ", " + rs2 + ", " + simm;
+        case OP_BLT: return "blt " + rs1 + ", " + rs2 + ", " + simm;
+        case OP_BGE: return "bge " + rs1 + ", " + rs2 + ", " + simm;
+        case OP_BLTU: return "bltu " + rs1 + ", " + rs2 + ", " + simm;
+        case OP_BGEU: return "bgeu " + rs1 + ", " + rs2 + ", " + simm;
+        case OP_LB: return "lb " + rd + ", " + simm + "(" + rs1 + ")";
+        case OP_LH: return "lh " + rd + ", " + simm + "(" + rs1 + ")";
+        case OP_LW: return "lw " + rd + ", " + simm + "(" + rs1 + ")";
+        case OP_LBU: return "lbu " + rd + ", " + simm + "(" + rs1 + ")";
+        case OP_LHU: return "lhu " + rd + ", " + simm + "(" + rs1 + ")";
+        case OP_SB: return "sb " + rs2 + ", " + simm + "(" + rs1 + ")";
+        case OP_SH: return "sh " + rs2 + ", " + simm + "(" + rs1 + ")";
+        case OP_SW: return "sw " + rs2 + ", " + simm + "(" + rs1 + ")";
+        case OP_ADDI: return "addi " + rd + ", " + rs1 + ", " + imm;
+        case OP_SLTI: return "slti " + rd + ", " + rs1 + ", " + imm;
+        case OP_SLTIU: return "sltiu " + rd + ", " + rs1 + ", " + imm;
+        case OP_XORI: return "xori " + rd + ", " + rs1 + ", " + imm;
+        case OP_ORI: return "ori " + rd + ", " + rs1 + ", " + imm;
+        case OP_ANDI: return "andi " + rd + ", " + rs1 + ", " + imm;
+        case OP_SLLI: return "slli " + rd + ", " + rs1 + ", " + imm;
+        case OP_SRLI: return "srli " + rd + ", " + rs1 + ", " + imm;
+        case OP_SRAI: return "srai " + rd + ", " + rs1 + ", " + imm;
+        case OP_ADD: return "add " + rd + ", " + rs1 + ", " + rs2;
+        case OP_SUB: return "sub " + rd + ", " + rs1 + ", " + rs2;
+        case OP_SLL: return "sll " + rd + ", " + rs1 + ", " + rs2;
+        case OP_SLT: return "slt " + rd + ", " + rs1 + ", " + rs2;
+        case OP_SLTU: return "sltu " + rd + ", " + rs1 + ", " + rs2;
+        case OP_XOR: return "xor " + rd + ", " + rs1 + ", " + rs2;
+        case OP_SRL: return "srl " + rd + ", " + rs1 + ", " + rs2;
+        case OP_SRA: return "sra " + rd + ", " + rs1 + ", " + rs2;
+        case OP_OR: return "or " + rd + ", " + rs1 + ", " + rs2;
+        case OP_AND: return "and " + rd + ", " + rs1 + ", " + rs2;
+        case OP_CSRRW: return "csrrw " + rd + ", " + imm + ", " + rs1;
+        case OP_CSRRS: return "csrrs " + rd + ", " + imm + ", " + rs1;
+        case OP_CSRRC: return "csrrc " + rd + ", " + imm + ", " + rs1;
+        case OP_CSRRWI: return "csrrwi " + rd + ", " + imm + ", " + rs1;
+        case OP_CSRRSI: return "csrrsi " + rd + ", " + imm + ", " + rs1;
+        case OP_CSRRCI: return "csrrci " + rd + ", " + imm + ", " + rs1;
+        case OP_MUL: return "mul " + rd + ", " + rs1 + ", " + rs2;
+        case OP_MULH: return "mulh " + rd + ", " + rs1 + ", " + rs2;
+        case OP_MULHSU: return "mulhsu " + rd + ", " + rs1 + ", " + rs2;
+        case OP_MULHU: return "mulhu " + rd + ", " + rs1 + ", " + rs2;
+        case OP_DIV: return "div " + rd + ", " + rs1 + ", " + rs2;
+        case OP_DIVU: return "divu " + rd + ", " + rs1 + ", " + rs2;
+        case OP_REM: return "rem " + rd + ", " + rs1 + ", " + rs2;
+        case OP_REMU: return "remu " + rd + ", " + rs1 + ", " + rs2;
+        case OP_FENCE: return "fence";
+        case OP_FENCE_I: return "fence.i";
+        case OP_ECALL: return "ecall";
+        case OP_MRET: return "mret";
+        case OP_WFI: return "wfi";
+        case OP_LR_W: return "lr.w " + rd + ", (" + rs1 + ")";
+        case OP_SC_W: return "sc.w " + rd + ", " + rs2 + ", (" + rs1 + ")";
+        case OP_AMOSWAP_W: return "amoswap.w " + rd + ", " + rs2 + ", (" + rs1 + ")";
+        case OP_AMOADD_W: return "amoadd.w " + rd + ", " + rs2 + ", (" + rs1 + ")";
+        case OP_AMOXOR_W: return "amoxor.w " + rd + ", " + rs2 + ", (" + rs1 + ")";
+        case OP_AMOAND_W: return "amoand.w " + rd + ", " + rs2 + ", (" + rs1 + ")";
+        case OP_AMOOR_W: return "amoor.w " + rd + ", " + rs2 + ", (" + rs1 + ")";
+        case OP_AMOMIN_W: return "amomin.w " + rd + ", " + rs2 + ", (" + rs1 + ")";
+        case OP_AMOMAX_W: return "amomax.w " + rd + ", " + rs2 + ", (" + rs1 + ")";
+        case OP_AMOMINU_W: return "amominu.w " + rd + ", " + rs2 + ", (" + rs1 + ")";
+        case OP_AMOMAXU_W: return "amomaxu.w " + rd + ", " + rs2 + ", (" + rs1 + ")";
+        case OP_FLW: return "flw f" + rd + ", " + simm + "(" + rs1 + ")";
+        case OP_FSW: return "fsw f" + rs2 + ", " + simm + "(" + rs1 + ")";
+        case OP_FMADD_S: return "fmadd.s f" + rd + ", f" + rs1 + ", f" + rs2 + ", f" + rs3;
+        case OP_FMSUB_S: return "fmsub.s f" + rd + ", f" + rs1 + ", f" + rs2 + ", f" + rs3;
+        case OP_FNMSUB_S: return "fnmsub.s f" + rd + ", f" + rs1 + ", f" + rs2 + ", f" + rs3;
+        case OP_FNMADD_S: return "fnmadd.s f" + rd + ", f" + rs1 + ", f" + rs2 + ", f" + rs3;
+        case OP_FADD_S: return "fadd.s f" + rd + ", f" + rs1 + ", f" + rs2;
+        case OP_FSUB_S: return "fsub.s f" + rd + ", f" + rs1 + ", f" + rs2;
+        case OP_FMUL_S: return "fmul.s f" + rd + ", f" + rs1 + ", f" + rs2;
+        case OP_FDIV_S: return "fdiv.s f" + rd + ", f" + rs1 + ", f" + rs2;
+        case OP_FSQRT_S: return "fsqrt.s f" + rd + ", f" + rs1;
+        case OP_FSGNJ_S: return "fsgnj.s f" + rd + ", f" + rs1 + ", f" + rs2;
+        case OP_FSGNJN_S: return "fsgnjn.s f" + rd + ", f" + rs1 + ", f" + rs2;
+        case OP_FSGNJX_S: return "fsgnjx.s f" + rd + ", f" + rs1 + ", f" + rs2;
+        case OP_FMIN_S: return "fmin.s f" + rd + ", f" + rs1 + ", f" + rs2;
+        case OP_FMAX_S: return "fmax.s f" + rd + ", f" + rs1 + ", f" + rs2;
+        case OP_FCVT_W_S: return "fcvt.w.s " + rd + ", f" + rs1;
+        case OP_FCVT_WU_S: return "fcvt.wu.s " + rd + ", f" + rs1;
+        case OP_FMV_X_W: return "fmv.x.w " + rd + ", f" + rs1;
+        case OP_FEQ_S: return "feq.s " + rd + ", f" + rs1 + ", f" + rs2;
+        case OP_FLT_S: return "flt.s " + rd + ", f" + rs1 + ", f" + rs2;
+        case OP_FLE_S: return "fle.s " + rd + ", f" + rs1 + ", f" + rs2;
+        case OP_FCLASS_S: return "fclass.s " + rd + ", f" + rs1;
+        case OP_FCVT_S_W: return "fcvt.s.w f" + rd + ", " + rs1;
+        case OP_FCVT_S_WU: return "fcvt.s.wu f" + rd + ", " + rs1;
+        case OP_FMV_W_X: return "fmv.w.x f" + rd + ", " + rs1;
+        case OP_LWU: return "lwu " + rd + ", " + simm + "(" + rs1 + ")";
+        case OP_LD: return "ld " + rd + ", " + simm + "(" + rs1 + ")";
+        case OP_SD: return "sd " + rs2 + ", " + simm + "(" + rs1 + ")";
+        case OP_ADDIW: return "addiw " + rd + ", " + rs1 + ", " + imm;
+        case OP_SLLIW: return "slliw " + rd + ", " + rs1 + ", " + imm;
+        case OP_SRLIW: return "srliw " + rd + ", " + rs1 + ", " + imm;
+        case OP_SRAIW: return "sraiw " + rd + ", " + rs1 + ", " + imm;
+        case OP_ADDW: return "addw " + rd + ", " + rs1 + ", " + rs2;
+        case OP_SUBW: return "subw " + rd + ", " + rs1 + ", " + rs2;
+        case OP_SLLW: return "sllw " + rd + ", " + rs1 + ", " + rs2;
+        case OP_SRLW: return "srlw " + rd + ", " + rs1 + ", " + rs2;
+        case OP_SRAW: return "sraw " + rd + ", " + rs1 + ", " + rs2;
+        case OP_MULW: return "mulw " + rd + ", " + rs1 + ", " + rs2;
+        case OP_DIVW: return "divw " + rd + ", " + rs1 + ", " + rs2;
+        case OP_DIVUW: return "divuw " + rd + ", " + rs1 + ", " + rs2;
+        case OP_REMW: return "remw " + rd + ", " + rs1 + ", " + rs2;
+        case OP_REMUW: return "remuw " + rd + ", " + rs1 + ", " + rs2;
+        default: return "";
+    }
+}
+
+void RISCV32::Trace32::print(const Record& rec, bool values, unsigned xlen) {
+    std::string msg = disasm(rec.instr);
+    if (msg.empty()) return;
+    if (values) {
+        Decoded32 inst;
+        decode32(rec.instr, &inst);
+        bool freg = writes_freg(inst.op);
+        char buf[80];
+        int width = freg ? 8 : xlen / 4;
+        bool load = (inst.op >= OP_LB && inst.op <= OP_LHU) || inst.op == OP_LR_W || inst.op == OP_FLW || inst.op == OP_LWU || inst.op == OP_LD;
+        bool amo = inst.op >= OP_SC_W && inst.op <= OP_AMOMAXU_W; // writes both rd and memory
+        bool store = (inst.op >= OP_SB && inst.op <= OP_SW) || inst.op == OP_FSW || inst.op == OP_SD || amo;
+        bool branch = inst.op >= OP_BEQ && inst.op <= OP_BGEU;
+        if ((!store || amo) && !branch && (inst.rd != 0 || freg)) {
+            snprintf(buf, sizeof(buf), "  %c%d = %0*llx", freg ? 'f' : 'x', inst.rd, width, (unsigned long long)rec.rd_value);
+            msg += buf;
+        }
+        if (load || store) {
+            snprintf(buf, sizeof(buf), "  [%08x] %s %0*llx", rec.mem_addr, store ? "<-" : "->", xlen / 4, (unsigned long long)rec.mem_value);
+            msg += buf;
+        }
+    }
+    print_inst(rec.pc, msg);
+}
+
+// Renders a binary trace back to the text form
+void RISCV32::print_trace(const char* trace_file, bool values) {
+    FILE* in = fopen(trace_file, "rb");
+    if (in == nullptr) {
+        throw std::runtime_error("Failed to open trace file.");
+    }
+    char magic[8];
+    unsigned xlen = 0;
+    if (fread(magic, 1, 8, in) == 8) {
+        if (std::string(magic, 8) == TRACE_MAGIC_RV32) xlen = 32;
+        if (std::string(magic, 8) == TRACE_MAGIC_RV64) xlen = 64;
+    }
+    if (xlen == 0) {
+        fclose(in);
+        throw std::runtime_error("Not a trace file.");
+    }
+    std::vector<Trace32::Record> recs(0x1000);
+    size_t count;
+    while ((count = fread(recs.data(), sizeof(Trace32::Record), recs.size(), in)) > 0) {
+        for (size_t i = 0; i < count; i++) Trace32::print(recs[i], values, xlen);
+    }
+    fclose(in);
+    std::cout.flush();
+}
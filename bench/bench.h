@@ -0,0 +1,22 @@
+#include <stdint.h>
+
+// Workloads stay inside RV32I: no multiply or divide, no libc
+
+static inline uint32_t xorshift32(uint32_t* state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static inline uint32_t mul32(uint32_t a, uint32_t b) {
+    uint32_t r = 0;
+    while (b != 0) {
+        if (b & 1) r += a;
+        a <<= 1;
+        b >>= 1;
+    }
+    return r;
+}
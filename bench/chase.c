@@ -0,0 +1,30 @@
+#include "bench.h"
+
+// Dependent loads around one random cycle over a buffer larger than a host L1
+#define NODES 16384 // power of two
+#define STEPS 1000000
+
+static uint32_t next[NODES];
+
+int main(void) {
+    // Sattolo's shuffle gives a single cycle through every node
+    for (uint32_t i = 0; i < NODES; i++) next[i] = i;
+    uint32_t rng = 0xDEADBEEF;
+    for (uint32_t i = NODES - 1; i > 0; i--) {
+        uint32_t mask = 1;
+        while (mask < i) mask = (mask << 1) | 1;
+        uint32_t j;
+        do {
+            j = xorshift32(&rng) & mask;
+        } while (j >= i);
+        uint32_t t = next[i];
+        next[i] = next[j];
+        next[j] = t;
+    }
+    uint32_t p = 0, sum = 0;
+    for (uint32_t s = 0; s < STEPS; s++) {
+        p = next[p];
+        sum += p;
+    }
+    return sum;
+}
@@ -0,0 +1,90 @@
+#include "bench.h"
+
+// CoreMark-style mix: linked list search and reversal, a small matrix kernel and CRC16 over the results
+#define LIST_SIZE 256
+#define MATRIX_N 12
+#define ITERATIONS 60
+
+struct node {
+    struct node* next;
+    int16_t data;
+    int16_t idx;
+};
+
+static struct node nodes[LIST_SIZE];
+static int16_t mat_a[MATRIX_N * MATRIX_N], mat_b[MATRIX_N * MATRIX_N];
+static int32_t mat_c[MATRIX_N * MATRIX_N];
+
+static uint16_t crc16_byte(uint8_t data, uint16_t crc) {
+    for (int i = 0; i < 8; i++) {
+        uint8_t x16 = (data & 1) ^ (crc & 1);
+        data >>= 1;
+        if (x16) {
+            crc ^= 0x4002;
+            crc = (crc >> 1) | 0x8000;
+        } else {
+            crc >>= 1;
+        }
+    }
+    return crc;
+}
+
+static uint16_t crc16(uint32_t value, uint16_t crc) {
+    for (int i = 0; i < 4; i++) crc = crc16_byte((uint8_t)(value >> (8 * i)), crc);
+    return crc;
+}
+
+static struct node* list_reverse(struct node* list) {
+    struct node* prev = 0;
+    while (list) {
+        struct node* next = list->next;
+        list->next = prev;
+        prev = list;
+        list = next;
+    }
+    return prev;
+}
+
+static struct node* list_find(struct node* list, int16_t data) {
+    while (list && list->data != data) list = list->next;
+    return list;
+}
+
+static uint32_t matrix_kernel(int16_t seed) {
+    for (int i = 0; i < MATRIX_N * MATRIX_N; i++) {
+        mat_a[i] = (int16_t)(seed + i);
+        mat_b[i] = (int16_t)((seed ^ i) & 0xff);
+    }
+    uint32_t sum = 0;
+    for (int i = 0; i < MATRIX_N; i++) {
+        for (int j = 0; j < MATRIX_N; j++) {
+            int32_t acc = 0;
+            for (int k = 0; k < MATRIX_N; k++) {
+                acc += (int32_t)mul32((uint32_t)(int32_t)mat_a[i * MATRIX_N + k], (uint32_t)(int32_t)mat_b[k * MATRIX_N + j]);
+            }
+            mat_c[i * MATRIX_N + j] = acc;
+            sum += (uint32_t)acc;
+        }
+    }
+    return sum;
+}
+
+int main(void) {
+    uint32_t rng = 0x2545F491;
+    for (int i = 0; i < LIST_SIZE; i++) {
+        nodes[i].next = (i + 1 < LIST_SIZE) ? &nodes[i + 1] : 0;
+        nodes[i].data = (int16_t)(xorshift32(&rng) & 0x3ff);
+        nodes[i].idx = (int16_t)i;
+    }
+    struct node* list = &nodes[0];
+    uint16_t crc = 0;
+    for (int iter = 0; iter < ITERATIONS; iter++) {
+        for (int q = 0; q < 32; q++) {
+            struct node* found = list_find(list, (int16_t)(xorshift32(&rng) & 0x3ff));
+            crc = crc16(found ? (uint32_t)found->idx : 0xffffffffu, crc);
+        }
+        list = list_reverse(list);
+        crc = crc16(matrix_kernel((int16_t)iter), crc);
+    }
+    return crc;
+}
@@ -0,0 +1,42 @@
+#include "bench.h"
+
+// CRC-32 both bit by bit and through a 256-entry table
+#define BUF_SIZE 4096
+#define ITERATIONS 12
+
+static uint8_t buf[BUF_SIZE];
+static uint32_t table[256];
+
+static uint32_t crc32_bitwise(const uint8_t* p, uint32_t n) {
+    uint32_t crc = 0xFFFFFFFF;
+    while (n--) {
+        crc ^= *p++;
+        for (int k = 0; k < 8; k++) crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static uint32_t crc32_table(const uint8_t* p, uint32_t n) {
+    uint32_t crc = 0xFFFFFFFF;
+    while (n--) crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+int main(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? (c >> 1) ^ 0xEDB88320 : c >> 1;
+        table[i] = c;
+    }
+    uint32_t rng = 0xCAFEBABE;
+    for (int i = 0; i < BUF_SIZE; i++) buf[i] = (uint8_t)xorshift32(&rng);
+    uint32_t sum = 0;
+    for (int iter = 0; iter < ITERATIONS; iter++) {
+        buf[iter] ^= 0x5a;
+        uint32_t a = crc32_bitwise(buf, BUF_SIZE);
+        uint32_t b = crc32_table(buf, BUF_SIZE);
+        for (int k = 0; k < 7; k++) b ^= crc32_table(buf, BUF_SIZE);
+        sum += a ^ b;
+    }
+    return sum;
+}
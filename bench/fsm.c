@@ -0,0 +1,57 @@
+#include "bench.h"
+
+// Branchy tokenizer: a byte-at-a-time state machine over generated source text
+#define TEXT_SIZE 16384
+#define PASSES 20
+
+enum state { START, IDENT, NUMBER, STRING, ESCAPE, COMMENT, OPERATOR };
+
+static char text[TEXT_SIZE];
+
+static const char alphabet[] = "abcxyz_019  \t\n\"\\/+-*=();{}";
+
+int main(void) {
+    uint32_t rng = 0x0BADF00D;
+    for (int i = 0; i < TEXT_SIZE; i++) {
+        uint32_t r = xorshift32(&rng) & 31;
+        text[i] = alphabet[r < sizeof(alphabet) - 1 ? r : r - 16];
+    }
+    uint32_t counts[7] = { 0, };
+    for (int pass = 0; pass < PASSES; pass++) {
+        enum state s = START;
+        for (int i = 0; i < TEXT_SIZE; i++) {
+            char c = text[i];
+            switch (s) {
+                case START:
+                case OPERATOR:
+                    if ((c >= 'a' && c <= 'z') || c == '_') s = IDENT;
+                    else if (c >= '0' && c <= '9') s = NUMBER;
+                    else if (c == '"') s = STRING;
+                    else if (c == '/' && i + 1 < TEXT_SIZE && text[i + 1] == '/') s = COMMENT;
+                    else if (c == ' ' || c == '\t' || c == '\n') s = START;
+                    else s = OPERATOR;
+                    break;
+                case IDENT:
+                    if (!((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '_')) s = (c == '"') ? STRING : START;
+                    break;
+                case NUMBER:
+                    if (c < '0' || c > '9') s = ((c >= 'a' && c <= 'z') || c == '_') ? IDENT : START;
+                    break;
+                case STRING:
+                    if (c == '\\') s = ESCAPE;
+                    else if (c == '"' || c == '\n') s = START;
+                    break;
+                case ESCAPE:
+                    s = STRING;
+                    break;
+                case COMMENT:
+                    if (c == '\n') s = START;
+                    break;
+            }
+            counts[s]++;
+        }
+    }
+    uint32_t sum = 0;
+    for (int k = 0; k < 7; k++) sum = (sum << 3) ^ (sum >> 29) ^ counts[k];
+    return sum;
+}
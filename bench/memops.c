@@ -0,0 +1,49 @@
+#include "bench.h"
+
+// Block copies and fills at the sizes and alignments a libc sees
+#define BUF_SIZE 8192
+#define ITERATIONS 200
+
+// Word arrays keep the word copies aligned; the byte copies go through uint8_t views
+static uint32_t src_words[(BUF_SIZE + 8) / 4], dst_words[(BUF_SIZE + 8) / 4];
+#define src ((uint8_t*)src_words)
+#define dst ((uint8_t*)dst_words)
+
+static void copy_bytes(uint8_t* d, const uint8_t* s, uint32_t n) {
+    while (n--) *d++ = *s++;
+}
+
+static void copy_words(uint32_t* d, const uint32_t* s, uint32_t n) {
+    for (; n >= 4; n -= 4, d += 4, s += 4) {
+        d[0] = s[0];
+        d[1] = s[1];
+        d[2] = s[2];
+        d[3] = s[3];
+    }
+    while (n--) *d++ = *s++;
+}
+
+static void fill_bytes(uint8_t* d, uint8_t c, uint32_t n) {
+    while (n--) *d++ = c;
+}
+
+static void fill_words(uint32_t* d, uint8_t c, uint32_t n) {
+    uint32_t w = c | (c << 8);
+    w |= w << 16;
+    while (n--) *d++ = w;
+}
+
+int main(void) {
+    uint32_t rng = 0x9E3779B9;
+    for (int i = 0; i < BUF_SIZE + 8; i++) src[i] = (uint8_t)xorshift32(&rng);
+    uint32_t sum = 0;
+    for (int iter = 0; iter < ITERATIONS; iter++) {
+        uint32_t off = iter & 7;
+        copy_words(dst_words, src_words, BUF_SIZE / 4);
+        copy_bytes(dst + off, src + (7 - off), BUF_SIZE);
+        fill_words(src_words, (uint8_t)iter, 64);
+        fill_bytes(dst + BUF_SIZE - 300 + off, (uint8_t)~iter, 300);
+        sum += dst[iter & (BUF_SIZE - 1)] + dst[BUF_SIZE - 1 - iter] + src[iter];
+    }
+    return sum;
+}
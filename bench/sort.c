@@ -0,0 +1,68 @@
+#include "bench.h"
+
+// Quicksort with an insertion sort cutoff, then a binary search pass over the result
+#define N 4096
+#define ROUNDS 6
+
+static int32_t data[N];
+
+static void insertion_sort(int32_t* a, int lo, int hi) {
+    for (int i = lo + 1; i <= hi; i++) {
+        int32_t v = a[i];
+        int j = i - 1;
+        while (j >= lo && a[j] > v) {
+            a[j + 1] = a[j];
+            j--;
+        }
+        a[j + 1] = v;
+    }
+}
+
+static void quicksort(int32_t* a, int lo, int hi) {
+    while (hi - lo > 16) {
+        int32_t pivot = a[lo + ((hi - lo) >> 1)];
+        int i = lo, j = hi;
+        while (i <= j) {
+            while (a[i] < pivot) i++;
+            while (a[j] > pivot) j--;
+            if (i <= j) {
+                int32_t t = a[i];
+                a[i] = a[j];
+                a[j] = t;
+                i++;
+                j--;
+            }
+        }
+        // Recurse into the smaller half to bound the stack
+        if (j - lo < hi - i) {
+            quicksort(a, lo, j);
+            lo = i;
+        } else {
+            quicksort(a, i, hi);
+            hi = j;
+        }
+    }
+    insertion_sort(a, lo, hi);
+}
+
+static int search(const int32_t* a, int32_t v) {
+    int lo = 0, hi = N - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) >> 1;
+        if (a[mid] == v) return mid;
+        if (a[mid] < v) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    return -1;
+}
+
+int main(void) {
+    uint32_t rng = 0x1234567;
+    uint32_t sum = 0;
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int i = 0; i < N; i++) data[i] = (int32_t)xorshift32(&rng) >> 8;
+        quicksort(data, 0, N - 1);
+        for (int i = 0; i < N; i += 4) sum += (uint32_t)search(data, data[i]) ^ (uint32_t)data[i];
+    }
+    return sum;
+}
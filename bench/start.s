@@ -0,0 +1,5 @@
+	.text
+	.globl	_start
+_start:
+	call	main
+	.word	0		# an all-zero word halts the emulator; the checksum stays in a0
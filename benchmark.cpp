@@ -0,0 +1,137 @@
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "RISCV32.h"
+
+#define BENCH_RUNS 5         // timed runs per program
+#define BENCH_REGRESSION 5.0 // % of MIPS lost against a baseline that counts as a regression
+
+struct Result {
+    std::string status;
+    uint32_t checksum = 0;
+    uint64_t instret = 0;
+    std::vector<double> seconds;
+};
+
+// Each run gets a fresh hart, so the JIT translates from scratch every time
+static void bench(const std::string& program, const std::string& mode, int runs, Result* result) {
+    bool jit = mode.find('j') != std::string::npos;
+    bool align = mode.find('m') != std::string::npos;
+    result->status = "ok";
+    for (int i = 0; i < runs; i++) {
+        try {
+            RISCV32 hart { jit, false, false, false, false, 32, program.c_str(), 0, 0 };
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            if (hart.get_xlen() == 64) {
+                if (align) hart.run<RISCV32::Config64<false, true> >();
+                else hart.run<RISCV32::Config64<false, false> >();
+            } else {
+                if (align) hart.run<RISCV32::Config32<false, true> >();
+                else hart.run<RISCV32::Config32<false, false> >();
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            result->seconds.push_back(elapsed.count());
+            result->instret = hart.get_instret();
+            result->checksum = hart.get_reg(10);
+        } catch (std::runtime_error &e) {
+            result->status = std::string("error: ") + e.what();
+            return;
+        }
+    }
+}
+
+// MIPS and checksums of an earlier run of this tool, keyed by program and mode
+static void read_baseline(const char* file, std::map<std::string, std::pair<double, std::string> >* baseline) {
+    std::ifstream in(file);
+    if (!in.is_open()) throw std::runtime_error("Failed to open baseline file.");
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        std::istringstream fields(line);
+        std::vector<std::string> cols;
+        std::string col;
+        while (std::getline(fields, col, '\t')) cols.push_back(col);
+        if (cols.size() < 10 || cols[3] != "ok") continue;
+        (*baseline)[cols[0] + '\t' + cols[1]] = std::make_pair(std::stod(cols[8]), cols[4]);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int runs = BENCH_RUNS;
+    std::string mode = "-";
+    const char* baseline_file = nullptr;
+    std::vector<std::string> programs;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-n" && i + 1 < argc) runs = std::stoi(argv[++i]);
+        else if (arg == "-m" && i + 1 < argc) mode = argv[++i];
+        else if (arg == "-b" && i + 1 < argc) baseline_file = argv[++i];
+        else programs.push_back(arg);
+    }
+    if (programs.empty() || runs < 1) {
+        std::cerr << "Usage: " << argv[0] << " [-n runs] [-m mode] [-b baseline] <program>..." << std::endl;
+        std::cerr << "       mode: j to translate hot blocks, m to disallow unaligned access" << std::endl;
+        std::cerr << "       baseline: earlier output of this tool to compare MIPS and checksums against" << std::endl;
+        return 1;
+    }
+
+    std::map<std::string, std::pair<double, std::string> > baseline;
+    try {
+        if (baseline_file != nullptr) read_baseline(baseline_file, &baseline);
+    } catch (std::exception &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    // One tab-separated line per program; a0 at exit is the workload's checksum
+    std::cout << "# program\tmode\truns\tstatus\tchecksum\tinstret\tmean_s\tstddev_s\tmips\tmips_stddev\tcv_%";
+    if (baseline_file != nullptr) std::cout << "\tbaseline_mips\tchange_%";
+    std::cout << std::endl;
+    int regressions = 0;
+    for (size_t p = 0; p < programs.size(); p++) {
+        Result r;
+        bench(programs[p], mode, runs, &r);
+        double mean = 0, var = 0;
+        for (size_t i = 0; i < r.seconds.size(); i++) mean += r.seconds[i];
+        if (!r.seconds.empty()) mean /= r.seconds.size();
+        for (size_t i = 0; i < r.seconds.size(); i++) var += (r.seconds[i] - mean) * (r.seconds[i] - mean);
+        if (r.seconds.size() > 1) var /= r.seconds.size() - 1;
+        double stddev = std::sqrt(var);
+        double mips = (mean > 0) ? r.instret / mean / 1e6 : 0;
+        double cv = (mean > 0) ? 100.0 * stddev / mean : 0;
+
+        char checksum[16];
+        snprintf(checksum, sizeof(checksum), "%08x", r.checksum);
+        char line[256];
+        snprintf(line, sizeof(line), "%s\t%d\t%s\t%s\t%llu\t%.6f\t%.6f\t%.2f\t%.2f\t%.2f",
+            mode.c_str(), runs, r.status.c_str(), checksum, (unsigned long long)r.instret, mean, stddev, mips, mips * cv / 100.0, cv);
+        std::cout << programs[p] << '\t' << line;
+
+        if (baseline_file != nullptr) {
+            std::map<std::string, std::pair<double, std::string> >::const_iterator it = baseline.find(programs[p] + '\t' + mode);
+            if (it == baseline.end() || r.status != "ok") {
+                std::cout << "\t-\t-";
+            } else {
+                double change = 100.0 * (mips - it->second.first) / it->second.first;
+                snprintf(line, sizeof(line), "\t%.2f\t%+.2f", it->second.first, change);
+                std::cout << line;
+                if (change < -BENCH_REGRESSION) {
+                    std::cerr << programs[p] << ": " << -change << "% fewer MIPS than the baseline" << std::endl;
+                    regressions++;
+                }
+                if (it->second.second != checksum) {
+                    std::cerr << programs[p] << ": checksum " << checksum << " differs from the baseline " << it->second.second << std::endl;
+                    regressions++;
+                }
+            }
+        }
+        std::cout << std::endl;
+        if (r.status != "ok") regressions++;
+    }
+    return regressions == 0 ? 0 : 1;
+}
@@ -1,49 +1,376 @@
+#include <cerrno>
+#include <cstdlib>
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include "RISCV32.h"
 
-int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << "<filename> [entry point] <mode> "<< std::endl;
-        return 1;
-    }
+#ifndef DEFAULT_XLEN
+#define DEFAULT_XLEN 32 // register width of flat binaries, ELF files bring their own
+#endif
 
+struct Options {
     uint32_t entry_point = 0x0;
-    if (argc >= 3) {
-        entry_point = std::stoi(argv[2], nullptr, 16);
-    }
-    
     bool mem_access = false;
-    bool debug = false; 
-    bool M, A, F = false;
-    if (argc >= 4) {
-        std::string flags = argv[3];
-        if (flags.find('m') != std::string::npos) {
-            mem_access = true;
+    bool debug = false;
+    bool trace = false;
+    bool raw_image = false, hex_image = false;
+    bool counters = false;
+    bool profile = false;
+    bool jit = false;
+    bool M = false, A = false, F = false, C = false;
+    unsigned harts = 1;
+    unsigned xlen = DEFAULT_XLEN;
+};
+
+static void parse_flags(const std::string& flags, Options* opt) {
+    if (flags.find('m') != std::string::npos) {
+        opt->mem_access = true;
+    }
+    if (flags.find('d') != std::string::npos) {
+        opt->debug = true;
+    }
+    if (flags.find('t') != std::string::npos) {
+        opt->trace = true;
+    }
+    if (flags.find('p') != std::string::npos) {
+        opt->profile = true;
+    }
+    if (flags.find('c') != std::string::npos) {
+        opt->counters = true;
+    }
+    if (flags.find('r') != std::string::npos) {
+        opt->raw_image = true;
+    }
+    if (flags.find('x') != std::string::npos) {
+        opt->hex_image = true;
+    }
+    if (flags.find('j') != std::string::npos) {
+        opt->jit = true;
+    }
+    if (flags.find('M') != std::string::npos) {
+        opt->M = true;
+    }
+    if (flags.find('A') != std::string::npos) {
+        opt->A = true;
+    }
+    if (flags.find('F') != std::string::npos) {
+        opt->F = true;
+    }
+    if (flags.find('C') != std::string::npos) {
+        opt->C = true;
+    }
+}
+
+// Hex addresses of the command line and the manifest, false unless the whole field fits in 32 bits
+static bool parse_hex(const std::string& field, uint32_t* value) {
+    if (field.empty() || field[0] == '-' || field[0] == '+') return false;
+    char* end = nullptr;
+    errno = 0;
+    unsigned long long parsed = std::strtoull(field.c_str(), &end, 16);
+    if (errno != 0 || *end != '\0' || parsed > UINT32_MAX) return false;
+    *value = parsed;
+    return true;
+}
+
+// Pick the specialized core once; the hot loop carries no mode checks
+static void run_hart(RISCV32& hart, const Options& opt) {
+    if (hart.get_xlen() == 64) {
+        if (opt.debug || opt.trace) {
+            if (opt.mem_access) hart.run<RISCV32::Config64<true, true> >();
+            else hart.run<RISCV32::Config64<true, false> >();
+        } else {
+            if (opt.mem_access) hart.run<RISCV32::Config64<false, true> >();
+            else hart.run<RISCV32::Config64<false, false> >();
         }
-        if (flags.find('d') != std::string::npos) {
-            debug = true;
+    } else if (opt.debug || opt.trace) {
+        if (opt.mem_access) hart.run<RISCV32::Config32<true, true> >();
+        else hart.run<RISCV32::Config32<true, false> >();
+    } else {
+        if (opt.mem_access) hart.run<RISCV32::Config32<false, true> >();
+        else hart.run<RISCV32::Config32<false, false> >();
+    }
+}
+
+// Files of the first hart sit next to the program, the others' carry their hart id
+static std::string hart_file(const std::string& program, size_t hart, const std::string& ext) {
+    if (hart == 0) return program + ext;
+    return program + ".hart" + std::to_string(hart) + ext;
+}
+
+// Further harts share the memory of the first and start at its entry point
+static void make_harts(const std::string& program, const Options& opt, std::vector<std::unique_ptr<RISCV32> >* harts) {
+    harts->push_back(std::unique_ptr<RISCV32>(new RISCV32 {
+        opt.jit, opt.M, opt.A, opt.F, opt.C, opt.xlen,
+        program.c_str(), 0, opt.entry_point
+    }));
+    for (unsigned i = 1; i < opt.harts; i++) {
+        harts->push_back(std::unique_ptr<RISCV32>(new RISCV32(harts->front().get(), i)));
+    }
+    for (size_t i = 0; i < harts->size(); i++) {
+        if (opt.trace) (*harts)[i]->set_trace_file(hart_file(program, i, ".trace"));
+        if (opt.profile) (*harts)[i]->enable_profile();
+    }
+}
+
+// Each further hart runs on its own thread, the first on this one; the first error is rethrown
+static void run_harts(std::vector<std::unique_ptr<RISCV32> >& harts, const Options& opt) {
+    std::vector<std::string> errors(harts.size());
+    auto run_one = [&](size_t i) {
+        try {
+            run_hart(*harts[i], opt);
+        } catch (std::runtime_error &e) {
+            errors[i] = e.what();
         }
-        if (flags.find('M') != std::string::npos) {
-            M = true;
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < harts.size(); i++) {
+        threads.push_back(std::thread(run_one, i));
+    }
+    run_one(0);
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    for (size_t i = 0; i < errors.size(); i++) {
+        if (errors[i].empty()) continue;
+        if (harts.size() == 1) throw std::runtime_error(errors[i]);
+        throw std::runtime_error("hart " + std::to_string(i) + ": " + errors[i]);
+    }
+}
+
+// Memory images go to files next to the program
+static void write_images(RISCV32& hart, const std::string& program, const Options& opt) {
+    if (opt.raw_image) hart.write_mem_image(program + ".mem", false);
+    if (opt.hex_image) hart.write_mem_image(program + ".hex", true);
+}
+
+// Batch mode
+struct Job {
+    std::string program;
+    Options opt;
+    uint32_t snapshot_pc = 0xFFFFFFFF; // later runs restore the machine from here, 0xFFFFFFFF for none
+    std::string key;                   // jobs with the same key share their machine and snapshot
+    std::string error;                 // the manifest line is broken, the job is not run
+};
+
+struct JobResult {
+    std::string status;
+    uint64_t instret = 0;
+    uint32_t pc = 0;
+    unsigned xlen = 32;
+    uint64_t reg[32] = {0, };
+};
+
+struct WorkQueue {
+    std::mutex lock;
+    std::deque<size_t> jobs;
+};
+
+// Machines of one worker that reached the snapshot point of their job
+typedef std::map<std::string, std::vector<std::unique_ptr<RISCV32> > > SnapshotCache;
+
+// The first job runs a fresh machine up to the snapshot point and saves it, later ones only restore it
+static std::vector<std::unique_ptr<RISCV32> >& restore_harts(const Job& job, SnapshotCache* snapshots) {
+    SnapshotCache::iterator it = snapshots->find(job.key);
+    if (it != snapshots->end()) {
+        it->second[0]->restore_snapshot();
+        return it->second;
+    }
+    if (job.opt.harts != 1) {
+        throw std::runtime_error("Snapshots take a single hart.");
+    }
+    std::vector<std::unique_ptr<RISCV32> > harts;
+    make_harts(job.program, job.opt, &harts);
+    RISCV32& hart = *harts[0];
+    hart.set_stop_pc(job.snapshot_pc);
+    run_harts(harts, job.opt);
+    if (hart.get_pc() != job.snapshot_pc) {
+        throw std::runtime_error("Snapshot point not reached.");
+    }
+    hart.save_snapshot();
+    hart.set_stop_pc(0xFFFFFFFF); // blocks already split there stay correct
+    return (*snapshots)[job.key] = std::move(harts);
+}
+
+static void run_job(const Job& job, JobResult* result, SnapshotCache* snapshots) {
+    if (!job.error.empty()) {
+        result->status = "error: " + job.error;
+        return;
+    }
+    try {
+        std::vector<std::unique_ptr<RISCV32> > fresh;
+        if (job.snapshot_pc == 0xFFFFFFFF) make_harts(job.program, job.opt, &fresh);
+        std::vector<std::unique_ptr<RISCV32> >& harts = fresh.empty() ? restore_harts(job, snapshots) : fresh;
+        RISCV32& hart = *harts[0];
+        try {
+            run_harts(harts, job.opt);
+            write_images(hart, job.program, job.opt);
+            result->status = "ok";
+            if (hart.get_exit_code() != 0) result->status = "exit " + std::to_string(hart.get_exit_code());
+        } catch (std::runtime_error &e) {
+            result->status = std::string("error: ") + e.what();
+        }
+        result->instret = hart.get_instret();
+        result->pc = hart.get_pc();
+        result->xlen = hart.get_xlen();
+        for (int i = 0; i < 32; i++) {
+            result->reg[i] = hart.get_reg(i);
+        }
+    } catch (std::runtime_error &e) {
+        result->status = std::string("error: ") + e.what();
+    }
+}
+
+// Each worker drains its own queue from the front and steals from the back of the others
+static void batch_worker(size_t id, std::vector<WorkQueue>& queues, const std::vector<Job>& jobs, std::vector<JobResult>& results) {
+    SnapshotCache snapshots;
+    while (true) {
+        bool found = false;
+        size_t job = 0;
+        for (size_t k = 0; k < queues.size() && !found; k++) {
+            WorkQueue& q = queues[(id + k) % queues.size()];
+            std::lock_guard<std::mutex> guard(q.lock);
+            if (q.jobs.empty()) continue;
+            if (k == 0) {
+                job = q.jobs.front();
+                q.jobs.pop_front();
+            } else {
+                job = q.jobs.back();
+                q.jobs.pop_back();
+            }
+            found = true;
         }
-        if (flags.find('A') != std::string::npos) {
-            A = true;
+        if (!found) return; // no job is ever queued after start
+        run_job(jobs[job], &results[job], &snapshots);
+    }
+}
+
+static int run_batch(const char* manifest_file, const char* results_file, unsigned threads) {
+    std::ifstream manifest(manifest_file);
+    if (!manifest.is_open()) {
+        std::cerr << "Error: Failed to open manifest file." << std::endl;
+        return 1;
+    }
+
+    // One job per line: <filename> [entry point] [mode] [harts] [snapshot point], '#' starts a comment
+    std::vector<Job> jobs;
+    std::string line;
+    while (std::getline(manifest, line)) {
+        std::istringstream fields(line);
+        Job job;
+        if (!(fields >> job.program) || job.program[0] == '#') continue;
+        std::string entry, flags, snapshot;
+        unsigned harts;
+        if (fields >> entry && !parse_hex(entry, &job.opt.entry_point)) job.error = "Bad entry point " + entry + ".";
+        if (fields >> flags) parse_flags(flags, &job.opt);
+        if (fields >> harts && harts > 0) job.opt.harts = harts;
+        if (fields >> snapshot) {
+            if (!parse_hex(snapshot, &job.snapshot_pc)) job.error = "Bad snapshot point " + snapshot + ".";
+            job.key = job.program + ' ' + entry + ' ' + flags + ' ' + std::to_string(job.opt.harts) + ' ' + snapshot;
+        }
+        jobs.push_back(job);
+    }
+
+    if (threads == 0) threads = std::thread::hardware_concurrency();
+    if (threads == 0) threads = 1;
+    if (threads > jobs.size() && !jobs.empty()) threads = jobs.size();
+
+    std::vector<WorkQueue> queues(threads);
+    for (size_t i = 0; i < jobs.size(); i++) {
+        queues[i % threads].jobs.push_back(i);
+    }
+    std::vector<JobResult> results(jobs.size());
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < threads; i++) {
+        workers.push_back(std::thread(batch_worker, i, std::ref(queues), std::cref(jobs), std::ref(results)));
+    }
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+
+    std::ofstream out(results_file);
+    if (!out.is_open()) {
+        std::cerr << "Error: Failed to open results file." << std::endl;
+        return 1;
+    }
+    int failed = 0;
+    out << "# program\tstatus\tinstret\tpc";
+    for (int i = 0; i < 32; i++) out << "\tx" << std::dec << i;
+    out << '\n';
+    for (size_t i = 0; i < jobs.size(); i++) {
+        const JobResult& r = results[i];
+        if (r.status != "ok") failed++;
+        out << jobs[i].program << '\t' << r.status << '\t' << std::dec << r.instret << '\t';
+        out.width(8);
+        out.fill('0');
+        out << std::hex << r.pc;
+        for (int k = 0; k < 32; k++) {
+            out << '\t';
+            out.width(r.xlen / 4);
+            out << r.reg[k];
         }
-        if (flags.find('F') != std::string::npos) {
-            F = true;
+        out << '\n';
+    }
+    std::cout << std::dec << jobs.size() << " programs, " << failed << " failed." << std::endl;
+    return failed == 0 ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc >= 2 && std::string(argv[1]) == "-b") {
+        if (argc < 4) {
+            std::cerr << "Usage: " << argv[0] << " -b <manifest> <results> [threads]" << std::endl;
+            return 1;
         }
+        unsigned threads = (argc >= 5) ? std::stoul(argv[4]) : 0;
+        return run_batch(argv[2], argv[3], threads);
+    }
+
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << "<filename> [entry point] <mode> [harts]"<< std::endl;
+        std::cerr << "       " << argv[0] << " -b <manifest> <results> [threads]" << std::endl;
+        return 1;
+    }
+
+    Options opt;
+    if (argc >= 3 && !parse_hex(argv[2], &opt.entry_point)) {
+        std::cerr << "Error: Bad entry point " << argv[2] << "." << std::endl;
+        return 1;
     }
+    if (argc >= 4) {
+        parse_flags(argv[3], &opt);
+    }
+    if (argc >= 5) {
+        opt.harts = std::stoul(argv[4]);
+        if (opt.harts == 0) opt.harts = 1;
+    }
+    int exit_code = 0;
     try {
-        RISCV32 hart {
-            mem_access, debug, M, A, F,
-            argv[1], 0, entry_point
-        };
-        hart.run();
+        std::vector<std::unique_ptr<RISCV32> > harts;
+        make_harts(argv[1], opt, &harts);
+        run_harts(harts, opt);
+        std::cout << "Program Ends." << std::endl;
+        if (opt.raw_image || opt.hex_image) write_images(*harts[0], argv[1], opt);
+        else harts[0]->print_mem_modified();
+        for (size_t i = 0; i < harts.size(); i++) {
+            if (harts.size() > 1 && (opt.counters || opt.profile)) std::cout << "Hart " << std::dec << i << std::endl;
+            if (opt.counters) harts[i]->print_counters();
+            if (opt.profile) {
+                harts[i]->print_profile();
+                harts[i]->write_folded_stacks(hart_file(argv[1], i, ".folded"));
+            }
+        }
+        exit_code = harts[0]->get_exit_code();
     } catch (std::runtime_error &e) {
+        std::cout.flush();
         std::cerr << "Error: " << e.what() << std::endl;
         return 1;
     }
-    return 0;
+    return exit_code;
 }
-
-
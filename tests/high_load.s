@@ -0,0 +1,9 @@
+# Linked at 0x80000000: the entry point and all of the code lie far above the flat binaries at 0
+    .globl _start
+_start:
+    addi a0, zero, 42
+    sw a0, 0x100(zero)
+    lw a1, 0x100(zero)
+    sub a0, a1, a0      # exits with 0 once the store has landed
+    li a7, 93
+    ecall
@@ -0,0 +1,20 @@
+#include <iostream>
+#include <string>
+#include "RISCV32.h"
+
+// Renders a binary trace written by a traced run back to its text form
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <trace file> [v]" << std::endl;
+        std::cerr << "       v: also print register write-backs and memory accesses" << std::endl;
+        return 1;
+    }
+    bool values = argc >= 3 && std::string(argv[2]).find('v') != std::string::npos;
+    try {
+        RISCV32::print_trace(argv[1], values);
+    } catch (std::runtime_error &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}